@@ -11,270 +11,2254 @@
 #include <curl/curl.h>
 #include <string>
 #include <vector>
+#include <memory>
+#include <map>
+#include <unordered_map>
+#include <cstdint>
+#include <cstring>
+#include <cerrno>
+#include <algorithm>
+#include <cmath>
+#include <random>
+#include <queue>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <future>
+#include <chrono>
+#include <filesystem>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+#include <poll.h>
+#include <csignal>
+#include <atomic>
+#if defined(__AVX2__) && defined(__FMA__)
+#include <immintrin.h>
+#endif
 #include "../misc/IniFile.hpp"
 
 using namespace std;
 
-// TODO: OpenAI compatible completion based LLM communication
-class LLM {
+// Local byte-level BPE tokenizer for counting tokens before a request is sent.
+// Loads a tiktoken style ranks file (one "<base64 token> <rank>" per line, as
+// shipped in llama3's tokenizer.model), the rank of a token is its id and its
+// merge priority. Pre-tokenization approximates the llama3 split pattern.
+class Tokenizer {
+public:
+    Tokenizer() {
+        fill(begin(m_byteRanks), end(m_byteRanks), NO_RANK);
+    }
+    virtual ~Tokenizer() {}
+
+    bool load(const string& filename) {
+        ifstream file(filename);
+        if (!file.is_open()) {
+            cerr << "Error: Could not open tokenizer file " << filename << endl;
+            return false;
+        }
+        
+        unordered_map<string, uint32_t> ranks;
+        string line;
+        size_t lineNumber = 0;
+        while (getline(file, line)) {
+            lineNumber++;
+            size_t space = line.find(' ');
+            if (space == string::npos) {
+                continue;
+            }
+            const char* rank = line.c_str() + space + 1;
+            char* end;
+            errno = 0;
+            unsigned long value = strtoul(rank, &end, 10);
+            if (end == rank || errno == ERANGE || value >= NO_RANK) {
+                cerr << "Error: Invalid rank at line " << lineNumber << " of tokenizer file " << filename << endl;
+                return false;
+            }
+            ranks[decodeBase64(line.substr(0, space))] = (uint32_t)value;
+        }
+        file.close();
+        
+        build(ranks);
+        return !ranks.empty();
+    }
+
+    size_t vocabSize() const {
+        return m_vocabSize;
+    }
+
+    vector<uint32_t> encode(const string& text) const {
+        vector<uint32_t> tokens;
+        vector<uint32_t> parts;
+        split(text, 0, text.size(), [&](size_t start, size_t end) {
+            merge(text, start, end, parts);
+            tokens.insert(tokens.end(), parts.begin(), parts.end());
+        });
+        return tokens;
+    }
+
+    size_t count(const string& text) const {
+        return count(text, 0, text.size());
+    }
+
+    // Count a large document on several threads, the text is cut only where
+    // pre-tokenization would cut anyway so the result equals count(text)
+    size_t count(const string& text, size_t threads) const {
+        if (threads <= 1 || text.size() < threads * 4096) {
+            return count(text);
+        }
+        
+        vector<size_t> bounds = { 0 };
+        for (size_t i = 1; i < threads; i++) {
+            size_t pos = max(bounds.back(), text.size() * i / threads);
+            while (pos < text.size() && !isCut(text, pos)) {
+                pos++;
+            }
+            bounds.push_back(pos);
+        }
+        bounds.push_back(text.size());
+        
+        vector<future<size_t>> counts;
+        for (size_t i = 0; i + 1 < bounds.size(); i++) {
+            counts.push_back(async(launch::async, [this, &text, &bounds, i] {
+                return count(text, bounds[i], bounds[i + 1]);
+            }));
+        }
+        size_t total = 0;
+        for (future<size_t>& c : counts) {
+            total += c.get();
+        }
+        return total;
+    }
+
+private:
+    static constexpr uint32_t NO_RANK = UINT32_MAX;
+    static constexpr uint64_t NO_PAIR = UINT64_MAX;
+
+    // Open addressing table of (left id, right id) -> merged rank, key and
+    // value side by side so a probe touches a single cache line
+    struct PairSlot {
+        uint64_t pair;
+        uint32_t rank;
+    };
+
+    uint32_t m_byteRanks[256];
+    vector<PairSlot> m_pairs;
+    size_t m_pairMask = 0;
+    size_t m_vocabSize = 0;
+
+    void build(const unordered_map<string, uint32_t>& ranks) {
+        m_vocabSize = ranks.size();
+        for (size_t b = 0; b < 256; b++) {
+            auto it = ranks.find(string(1, (char)b));
+            m_byteRanks[b] = it == ranks.end() ? NO_RANK : it->second;
+        }
+        
+        // Every split of a token into two known tokens is a merge producing it
+        vector<pair<uint64_t, uint32_t>> pairs;
+        for (const auto& [token, rank] : ranks) {
+            for (size_t cut = 1; cut < token.size(); cut++) {
+                auto left = ranks.find(token.substr(0, cut));
+                if (left == ranks.end()) {
+                    continue;
+                }
+                auto right = ranks.find(token.substr(cut));
+                if (right != ranks.end()) {
+                    pairs.push_back({ key(left->second, right->second), rank });
+                }
+            }
+        }
+        
+        size_t capacity = 16;
+        while (capacity < pairs.size() * 2) {
+            capacity <<= 1;
+        }
+        m_pairs.assign(capacity, PairSlot{ NO_PAIR, NO_RANK });
+        m_pairMask = capacity - 1;
+        for (const auto& [pair, rank] : pairs) {
+            size_t slot = hash(pair) & m_pairMask;
+            while (m_pairs[slot].pair != NO_PAIR && m_pairs[slot].pair != pair) {
+                slot = (slot + 1) & m_pairMask;
+            }
+            m_pairs[slot] = PairSlot{ pair, rank };
+        }
+    }
+
+    static uint64_t key(uint32_t left, uint32_t right) {
+        return ((uint64_t)left << 32) | right;
+    }
+
+    static size_t hash(uint64_t pair) {
+        return (size_t)((pair * 0x9E3779B97F4A7C15ull) >> 17);
+    }
+
+    uint32_t mergedRank(uint32_t left, uint32_t right) const {
+        if (m_pairs.empty() || left == NO_RANK || right == NO_RANK) {
+            return NO_RANK;
+        }
+        uint64_t pair = key(left, right);
+        size_t slot = hash(pair) & m_pairMask;
+        while (m_pairs[slot].pair != NO_PAIR) {
+            if (m_pairs[slot].pair == pair) {
+                return m_pairs[slot].rank;
+            }
+            slot = (slot + 1) & m_pairMask;
+        }
+        return NO_RANK;
+    }
+
+    // Byte pair merge of text[start, end) into token ids, lowest rank first
+    void merge(const string& text, size_t start, size_t end, vector<uint32_t>& parts) const {
+        parts.clear();
+        for (size_t i = start; i < end; i++) {
+            parts.push_back(m_byteRanks[(unsigned char)text[i]]);
+        }
+        while (parts.size() > 1) {
+            uint32_t best = NO_RANK;
+            size_t at = 0;
+            for (size_t i = 0; i + 1 < parts.size(); i++) {
+                uint32_t rank = mergedRank(parts[i], parts[i + 1]);
+                if (rank < best) {
+                    best = rank;
+                    at = i;
+                }
+            }
+            if (best == NO_RANK) {
+                break;
+            }
+            parts[at] = best;
+            parts.erase(parts.begin() + at + 1);
+        }
+    }
+
+    size_t count(const string& text, size_t start, size_t end) const {
+        size_t total = 0;
+        vector<uint32_t> parts;
+        split(text, start, end, [&](size_t from, size_t to) {
+            merge(text, from, to, parts);
+            total += parts.size();
+        });
+        return total;
+    }
+
+    static bool isLetter(unsigned char c) {
+        return isalpha(c) || c >= 0x80; // UTF-8 sequences are taken as letters
+    }
+
+    static bool isDigit(unsigned char c) {
+        return c >= '0' && c <= '9';
+    }
+
+    static bool isSpace(unsigned char c) {
+        return c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == '\v' || c == '\f';
+    }
+
+    static bool isNewline(unsigned char c) {
+        return c == '\n' || c == '\r';
+    }
+
+    static bool isPunct(unsigned char c) {
+        return !isLetter(c) && !isDigit(c) && !isSpace(c);
+    }
+
+    // A single space between two non-space characters always starts a new piece
+    static bool isCut(const string& text, size_t pos) {
+        return pos > 0 && pos + 1 < text.size() && text[pos] == ' ' 
+            && !isSpace(text[pos - 1]) && !isSpace(text[pos + 1]);
+    }
+
+    // Pre-tokenize text[start, end) and call piece(from, to) for every piece
+    template<typename Piece>
+    static void split(const string& text, size_t start, size_t end, Piece piece) {
+        size_t i = start;
+        while (i < end) {
+            unsigned char c = text[i];
+            size_t j = i + 1;
+            if (c == '\'' && contraction(text, j, end) > j) {
+                j = contraction(text, j, end); // 's 't 're 've 'm 'll 'd
+            } else if (isLetter(c) || (!isNewline(c) && !isDigit(c) && j < end && isLetter(text[j]))) {
+                while (j < end && isLetter(text[j])) {
+                    j++;
+                }
+            } else if (isDigit(c)) {
+                while (j < end && j < i + 3 && isDigit(text[j])) {
+                    j++;
+                }
+            } else if (isPunct(c) || (c == ' ' && j < end && isPunct(text[j]))) {
+                while (j < end && isPunct(text[j])) {
+                    j++;
+                }
+                while (j < end && isNewline(text[j])) {
+                    j++;
+                }
+            } else {
+                while (j < end && isSpace(text[j])) {
+                    j++;
+                }
+                size_t lastNewline = string::npos;
+                for (size_t k = i; k < j; k++) {
+                    if (isNewline(text[k])) {
+                        lastNewline = k;
+                    }
+                }
+                if (lastNewline != string::npos) {
+                    j = lastNewline + 1;
+                } else if (j < end && j - i > 1) {
+                    j--; // leave the last space to the next word
+                }
+            }
+            piece(i, j);
+            i = j;
+        }
+    }
+
+    static size_t contraction(const string& text, size_t pos, size_t end) {
+        static const char* suffixes[] = { "ll", "re", "ve", "s", "t", "m", "d" };
+        for (const char* suffix : suffixes) {
+            size_t len = strlen(suffix);
+            if (pos + len > end) {
+                continue;
+            }
+            size_t k = 0;
+            while (k < len && tolower((unsigned char)text[pos + k]) == suffix[k]) {
+                k++;
+            }
+            if (k == len) {
+                return pos + len;
+            }
+        }
+        return pos;
+    }
+
+    static string decodeBase64(const string& encoded) {
+        string decoded;
+        uint32_t buffer = 0;
+        int bits = 0;
+        for (char c : encoded) {
+            int value;
+            if (c >= 'A' && c <= 'Z') value = c - 'A';
+            else if (c >= 'a' && c <= 'z') value = c - 'a' + 26;
+            else if (c >= '0' && c <= '9') value = c - '0' + 52;
+            else if (c == '+') value = 62;
+            else if (c == '/') value = 63;
+            else break;
+            buffer = (buffer << 6) | value;
+            bits += 6;
+            if (bits >= 8) {
+                bits -= 8;
+                decoded += (char)((buffer >> bits) & 0xFF);
+            }
+        }
+        return decoded;
+    }
+};
+
+// Escape JSON special characters
+inline string escapeJson(const string& str) {
+    string result;
+    for (char c : str) {
+        switch (c) {
+            case '"': result += "\\\""; break;
+            case '\\': result += "\\\\"; break;
+            case '\b': result += "\\b"; break;
+            case '\f': result += "\\f"; break;
+            case '\n': result += "\\n"; break;
+            case '\r': result += "\\r"; break;
+            case '\t': result += "\\t"; break;
+            default: result += c; break;
+        }
+    }
+    return result;
+}
+
+// Settings read from config.ini, parsed once and shared between conversations
+struct LLMConfig {
+    string apiEndpoint;
+    string model;
+    long timeout;        // seconds for a whole request, 0 waits forever
+    long connectTimeout; // seconds, 0 for the curl default
+    string embeddingsEndpoint;
+    string embeddingsModel;
+
+    static LLMConfig load(const string& filename = "config.ini") {
+        IniFile ini;
+        ini.load(filename);
+        LLMConfig config;
+        config.apiEndpoint = ini.getopt<string>("api_endpoint", "http://localhost:11434/v1/chat/completions", "llm");
+        config.model = ini.getopt<string>("model", "llama3", "llm");
+        config.timeout = ini.getopt<long>("timeout", 0, "llm");
+        config.connectTimeout = ini.getopt<long>("connect_timeout", 0, "llm");
+        config.embeddingsEndpoint = ini.getopt<string>("embeddings_endpoint", "http://localhost:11434/v1/embeddings", "llm");
+        config.embeddingsModel = ini.getopt<string>("embeddings_model", "nomic-embed-text", "llm");
+        return config;
+    }
+};
+
+// Holds the current LLMConfig as an immutable snapshot. reload() parses the
+// file into a new snapshot and publishes it, requests that already took the
+// old one keep it until they finish. watch() reloads on file changes (inotify)
+// and on SIGHUP. The current snapshot is swapped with std::atomic_load/store on
+// a shared_ptr, which may lock; snapshot() only goes there once per thread and
+// store after each reload and otherwise hands out the copy cached by the thread.
+class ConfigStore {
+public:
+    ConfigStore(const string& filename = "config.ini"): 
+        m_filename(filename),
+        m_slot(stores()++ % CACHED_STORES)
+    {
+        publish(make_shared<LLMConfig>(LLMConfig::load(filename)));
+    }
+
+    virtual ~ConfigStore() {
+        m_stop = true;
+        if (m_watcher.joinable()) {
+            m_watcher.join();
+            unwatchHangup();
+        }
+    }
+
+    shared_ptr<const LLMConfig> snapshot() const {
+        // A few cached snapshots per thread, each store has its own slot. Generations are unique
+        // across stores, so a store sharing the slot of another one only misses the cache.
+        struct Cached {
+            uint64_t generation = 0;
+            shared_ptr<const LLMConfig> config;
+        };
+        thread_local Cached cache[CACHED_STORES];
+        Cached& cached = cache[m_slot];
+        uint64_t generation = m_generation.load(memory_order_acquire);
+        if (cached.generation != generation) {
+            cached.config = atomic_load_explicit(&m_current, memory_order_acquire);
+            cached.generation = generation;
+        }
+        return cached.config;
+    }
+
+    // Publish a new snapshot, generations are unique across all stores
+    void publish(shared_ptr<const LLMConfig> config) {
+        static atomic<uint64_t> generations(0);
+        atomic_store_explicit(&m_current, config, memory_order_release);
+        m_generation.store(++generations, memory_order_release);
+    }
+
+    // Publish the file as it is now, a missing or unreadable file keeps the current snapshot
+    bool reload() {
+        if (!ifstream(m_filename)) {
+            cerr << "Error: Could not read " << m_filename << ", keeping the current config" << endl;
+            return false;
+        }
+        publish(make_shared<LLMConfig>(LLMConfig::load(m_filename)));
+        return true;
+    }
+
+    // Start a thread reloading the config when its file is written or replaced, or on SIGHUP.
+    // A SIGHUP handler the program had before is still called, and put back once no store watches.
+    void watch() {
+        if (m_watcher.joinable()) {
+            return;
+        }
+        watchHangup();
+        m_watcher = thread([this] { work(); });
+    }
+
+private:
+    // Process wide SIGHUP state shared by every watching store
+    struct Hangup {
+        static inline atomic<int> count{ 0 };
+        static inline struct sigaction previous = {};
+        static inline mutex installMutex;
+        static inline size_t watchers = 0;
+    };
+    static_assert(atomic<int>::is_always_lock_free, "SIGHUP counter must be usable from a signal handler");
+
+    static constexpr size_t CACHED_STORES = 8;
+
+    string m_filename;
+    size_t m_slot; // of the per-thread snapshot cache
+    shared_ptr<const LLMConfig> m_current; // only accessed through atomic_load/atomic_store
+    atomic<uint64_t> m_generation{ 0 };
+    atomic<bool> m_stop{ false };
+    thread m_watcher;
+
+    static atomic<size_t>& stores() {
+        static atomic<size_t> count(0);
+        return count;
+    }
+
+    static void onHangup(int sig, siginfo_t* info, void* context) {
+        Hangup::count.fetch_add(1, memory_order_relaxed);
+        const struct sigaction& previous = Hangup::previous;
+        if (previous.sa_flags & SA_SIGINFO) {
+            if (previous.sa_sigaction) {
+                previous.sa_sigaction(sig, info, context);
+            }
+        } else if (previous.sa_handler != SIG_DFL && previous.sa_handler != SIG_IGN) {
+            previous.sa_handler(sig);
+        }
+    }
+
+    static void watchHangup() {
+        lock_guard<mutex> lock(Hangup::installMutex);
+        if (Hangup::watchers++ > 0) {
+            return;
+        }
+        struct sigaction action = {};
+        action.sa_sigaction = onHangup;
+        sigemptyset(&action.sa_mask);
+        action.sa_flags = SA_RESTART | SA_SIGINFO;
+        sigaction(SIGHUP, &action, &Hangup::previous);
+    }
+
+    static void unwatchHangup() {
+        lock_guard<mutex> lock(Hangup::installMutex);
+        if (--Hangup::watchers == 0) {
+            sigaction(SIGHUP, &Hangup::previous, nullptr);
+        }
+    }
+
+    void work() {
+        // Watch the directory, editors often replace the file instead of writing it.
+        // A created file is only read once it is closed, not while it is still empty.
+        filesystem::path path(m_filename);
+        string dir = path.has_parent_path() ? path.parent_path().string() : ".";
+        string name = path.filename().string();
+        int fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if (fd >= 0 && inotify_add_watch(fd, dir.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+            cerr << "Error: Could not watch " << dir << " for config changes" << endl;
+            close(fd);
+            fd = -1;
+        }
+        
+        int seen = Hangup::count.load();
+        char buffer[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+        while (!m_stop) {
+            // Wake up now and then to notice SIGHUP and stop()
+            struct pollfd pfd = { fd, POLLIN, 0 };
+            bool changed = false;
+            if (poll(&pfd, fd >= 0 ? 1 : 0, 200) > 0) {
+                ssize_t len;
+                while ((len = read(fd, buffer, sizeof(buffer))) > 0) {
+                    for (char* p = buffer; p < buffer + len; ) {
+                        struct inotify_event* event = (struct inotify_event*)p;
+                        if (event->len && name == event->name) {
+                            changed = true;
+                        }
+                        p += sizeof(struct inotify_event) + event->len;
+                    }
+                }
+            }
+            if (seen != Hangup::count.load()) {
+                seen = Hangup::count.load();
+                changed = true;
+            }
+            if (changed) {
+                try {
+                    reload();
+                } catch (exception& e) {
+                    cerr << "Error: Could not reload " << m_filename << ": " << e.what() << endl;
+                }
+            }
+        }
+        if (fd >= 0) {
+            close(fd);
+        }
+    }
+};
+
+// Pool of curl handles, any number of conversations can share one transport
+class Transport {
 public:
-    LLM() {
+    Transport(size_t poolSize = 1): m_poolSize(poolSize ? poolSize : 1) {
         // Initialize curl
         curl_global_init(CURL_GLOBAL_DEFAULT);
-        m_curl = curl_easy_init();
-        // Load configuration from INI file
-        loadConfig();
     }
-    
-    virtual ~LLM() {
-        if (m_curl) {
-            curl_easy_cleanup(m_curl);
+
+    virtual ~Transport() {
+        for (CURL* curl : m_idle) {
+            if (curl) {
+                curl_easy_cleanup(curl);
+            }
+        }
+        curl_global_cleanup();
+    }
+
+    // POST a JSON body and return the raw response, blocks while every handle of the pool is busy
+    string post(const string& endpoint, const string& requestBody, long timeout = 0, long connectTimeout = 0) {
+        CURL* curl = acquire();
+        string response;
+        
+        curl_easy_setopt(curl, CURLOPT_URL, endpoint.c_str());
+        curl_easy_setopt(curl, CURLOPT_POST, 1L);
+        
+        // Handles are reused, so timeouts are set on every request
+        curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L);
+        curl_easy_setopt(curl, CURLOPT_TIMEOUT, timeout);
+        curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT, connectTimeout);
+        
+        // Set headers
+        struct curl_slist* headers = nullptr;
+        headers = curl_slist_append(headers, "Content-Type: application/json");
+        curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
+        
+        // Set request body
+        curl_easy_setopt(curl, CURLOPT_POSTFIELDS, requestBody.c_str());
+        
+        // Set write callback
+        curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, writeCallback);
+        curl_easy_setopt(curl, CURLOPT_WRITEDATA, &response);
+        
+        // Perform request
+        CURLcode res = curl_easy_perform(curl);
+        
+        // Clean up headers
+        curl_slist_free_all(headers);
+        release(curl);
+        
+        if (res != CURLE_OK) {
+            cerr << "API request failed: " << curl_easy_strerror(res) << endl;
+            return "";
+        }
+        
+        return response;
+    }
+
+private:
+    size_t m_poolSize;
+    size_t m_created = 0;
+    vector<CURL*> m_idle;
+    mutex m_mutex;
+    condition_variable m_released;
+
+    // Take an idle handle, or open a new one while the pool is not full
+    CURL* acquire() {
+        unique_lock<mutex> lock(m_mutex);
+        m_released.wait(lock, [this] { return !m_idle.empty() || m_created < m_poolSize; });
+        if (!m_idle.empty()) {
+            CURL* curl = m_idle.back();
+            m_idle.pop_back();
+            return curl;
+        }
+        m_created++;
+        return curl_easy_init();
+    }
+
+    void release(CURL* curl) {
+        {
+            lock_guard<mutex> lock(m_mutex);
+            m_idle.push_back(curl);
+        }
+        m_released.notify_one();
+    }
+    
+    // Callback for curl to write response data
+    static size_t writeCallback(void* contents, size_t size, size_t nmemb, void* userp) {
+        ((string*)userp)->append((char*)contents, size * nmemb);
+        return size * nmemb;
+    }
+};
+
+// TODO: OpenAI compatible completion based LLM communication
+class LLM {
+public:
+    LLM(): 
+        m_configs(make_shared<ConfigStore>()), 
+        m_ownTransport(make_unique<Transport>()), 
+        m_transport(m_ownTransport.get()) {}
+
+    // Share a config and transport with other conversations (see SessionManager)
+    LLM(shared_ptr<ConfigStore> configs, Transport& transport): 
+        m_configs(configs), 
+        m_transport(&transport) {}
+    
+    virtual ~LLM() {}
+
+    shared_ptr<ConfigStore> configs() const {
+        return m_configs;
+    }
+
+    Transport& transport() const {
+        return *m_transport;
+    }
+
+    // TODO: update system prompt 
+    void setSystemPrompt(const string& systemPrompt) {
+        this->systemPrompt = systemPrompt;
+        m_systemTokens = NOT_COUNTED;
+        // Add system prompt as first message in history
+        chatHistory.clear();
+        chatHistory.push_back(Message{"system", systemPrompt});
+    }
+    
+    // TODO: implement completion, update the history, return the inference - if show: show the incoming stream as is on stdout - use prompt with a callback to show as it comes
+    string prompt(const string& prompt, bool show = true) {
+        // Add user prompt to history
+        chatHistory.push_back(Message{"user", prompt});
+        
+        // Whole request uses the config as it was when it started
+        shared_ptr<const LLMConfig> config = m_configs->snapshot();
+        
+        // Build JSON request
+        string requestBody = buildJsonRequest(*config, false);
+        
+        // Make API call
+        string responseText = makeApiCall(*config, requestBody);
+        
+        if (show) {
+            cout << responseText << endl;
+        }
+        
+        // Add assistant response to history
+        chatHistory.push_back(Message{"assistant", responseText});
+        
+        return responseText;
+    }
+
+    // TODO: same as prompt above but using stream response and calls callback on chuncks for further processing. - note: callback can override chunks if necessary
+    string prompt(const string& prompt, function<string(string)> callback) {
+        // Add user prompt to history
+        chatHistory.push_back(Message{"user", prompt});
+        
+        // Whole request uses the config as it was when it started
+        shared_ptr<const LLMConfig> config = m_configs->snapshot();
+        
+        // Build JSON request with streaming enabled
+        string requestBody = buildJsonRequest(*config, true);
+        
+        // Make API call with streaming
+        string responseText = makeApiCallStreaming(*config, requestBody, callback);
+        
+        // Add assistant response to history
+        chatHistory.push_back(Message{"assistant", responseText});
+        
+        return responseText;
+    }
+
+    // Write the system prompt and history to a stream, so an idle conversation can be parked on disk
+    void save(ostream& out) const {
+        out << systemPrompt.size() << "\n" << systemPrompt << "\n";
+        out << chatHistory.size() << "\n";
+        for (const Message& msg : chatHistory) {
+            out << msg.role << " " << msg.text.size() << "\n" << msg.text << "\n";
+        }
+    }
+
+    // Read back what save() wrote, returns false on a truncated or malformed stream
+    bool load(istream& in) {
+        string prompt;
+        size_t count;
+        if (!readBlock(in, prompt) || !(in >> count)) {
+            return false;
+        }
+        vector<Message> history;
+        for (size_t i = 0; i < count; i++) {
+            Message msg;
+            if (!(in >> msg.role) || !readBlock(in, msg.text)) {
+                return false;
+            }
+            history.push_back(msg);
+        }
+        systemPrompt = prompt;
+        m_systemTokens = NOT_COUNTED;
+        chatHistory = history;
+        return true;
+    }
+
+    // Use a local tokenizer for countTokens(), cached counts of the old one are dropped
+    void setTokenizer(shared_ptr<const Tokenizer> tokenizer) {
+        m_tokenizer = tokenizer;
+        m_systemTokens = NOT_COUNTED;
+        for (Message& msg : chatHistory) {
+            msg.tokens = NOT_COUNTED;
+        }
+    }
+
+    // Count the tokens buildJsonRequest would send for prompt, without asking the server.
+    // The system prompt and history messages are tokenized once, later calls reuse their cached counts.
+    size_t countTokens(const string& prompt) {
+        if (!m_tokenizer) {
+            cerr << "Error: No tokenizer set" << endl;
+            return 0;
+        }
+        size_t total = 0;
+        if (!systemPrompt.empty()) {
+            if (m_systemTokens == NOT_COUNTED) {
+                m_systemTokens = countMessage("system", systemPrompt);
+            }
+            total += m_systemTokens;
+        }
+        for (Message& msg : chatHistory) {
+            // The system message in the history is sent once, as systemPrompt
+            if (msg.role == "system") {
+                continue;
+            }
+            if (msg.tokens == NOT_COUNTED) {
+                msg.tokens = countMessage(msg.role, msg.text);
+            }
+            total += msg.tokens;
+        }
+        return total + countMessage("user", prompt);
+    }
+
+protected:
+
+    static constexpr size_t NOT_COUNTED = SIZE_MAX;
+
+    struct Message {
+        string role;
+        string text;
+        size_t tokens = NOT_COUNTED; // cached by countTokens()
+        // TODO: feel free to change the Message if necessary
+    };
+
+    string systemPrompt; // TODO: store spec system prompts if necessary
+    vector<Message> chatHistory; // TODO: store history here
+    
+private:
+    shared_ptr<ConfigStore> m_configs;
+    unique_ptr<Transport> m_ownTransport; // only set when not shared
+    Transport* m_transport;
+    shared_ptr<const Tokenizer> m_tokenizer;
+    size_t m_systemTokens = NOT_COUNTED; // cached by countTokens()
+
+    // Header, role, separator and end of turn tokens of the llama3 chat template
+    static constexpr size_t MESSAGE_OVERHEAD = 4;
+
+    size_t countMessage(const string& role, const string& text) const {
+        return MESSAGE_OVERHEAD + m_tokenizer->count(role) + m_tokenizer->count(text);
+    }
+    
+    // Read a "<size>\n<bytes>\n" block written by save(). The size is not trusted,
+    // the text grows as it is read so a corrupted one ends at the end of the stream.
+    static bool readBlock(istream& in, string& text) {
+        size_t size;
+        if (!(in >> size) || in.get() != '\n') {
+            return false;
+        }
+        text.clear();
+        char buffer[65536];
+        while (size > 0) {
+            size_t n = min(size, sizeof(buffer));
+            if (!in.read(buffer, n)) {
+                return false;
+            }
+            text.append(buffer, n);
+            size -= n;
+        }
+        return in.get() == '\n';
+    }
+    
+    // Build JSON request for OpenAI-compatible API, prompt() has already added the user prompt to the history
+    string buildJsonRequest(const LLMConfig& config, bool stream) {
+        stringstream ss;
+        ss << "{";
+        ss << "\"model\": \"" << escapeJson(config.model) << "\",";
+        ss << "\"stream\": " << (stream ? "true" : "false") << ",";
+        ss << "\"messages\": [";
+        
+        // Add system message if available
+        const char* separator = "";
+        if (!systemPrompt.empty()) {
+            ss << "{\"role\": \"system\", \"content\": \"" << escapeJson(systemPrompt) << "\"}";
+            separator = ",";
+        }
+        
+        // Add chat history, its system message was already sent above
+        for (const Message& msg : chatHistory) {
+            if (msg.role == "system") {
+                continue;
+            }
+            ss << separator << "{\"role\": \"" << msg.role << "\", \"content\": \"" << escapeJson(msg.text) << "\"}";
+            separator = ",";
+        }
+        
+        ss << "]}";
+        
+        return ss.str();
+    }
+    
+    // Extract content from JSON response
+    string extractContent(const string& json) {
+        // Simple JSON parsing - look for "content" field
+        size_t contentPos = json.find("\"content\"");
+        if (contentPos == string::npos) {
+            return "";
+        }
+        
+        // Find the value after "content"
+        size_t colonPos = json.find(":", contentPos);
+        if (colonPos == string::npos) {
+            return "";
+        }
+        
+        // Find the opening quote
+        size_t quotePos = json.find("\"", colonPos);
+        if (quotePos == string::npos) {
+            return "";
+        }
+        
+        // Find the closing quote (simple approach - may not handle all cases)
+        size_t closeQuotePos = json.find("\"", quotePos + 1);
+        if (closeQuotePos == string::npos) {
+            return "";
+        }
+        
+        return json.substr(quotePos + 1, closeQuotePos - quotePos - 1);
+    }
+    
+    // Make API call without streaming
+    string makeApiCall(const LLMConfig& config, const string& requestBody) {
+        string response = m_transport->post(config.apiEndpoint, requestBody, config.timeout, config.connectTimeout);
+        if (response.empty()) {
+            return "";
+        }
+        
+        // Parse response (simple extraction of content field)
+        return extractContent(response);
+    }
+    
+    // Make API call with streaming
+    string makeApiCallStreaming(const LLMConfig& config, const string& requestBody, function<string(string)> callback) {
+        string accumulatedResponse;
+        string response = m_transport->post(config.apiEndpoint, requestBody, config.timeout, config.connectTimeout);
+        if (response.empty()) {
+            return "";
+        }
+        
+        // Parse streaming response
+        istringstream stream(response);
+        string line;
+        while (getline(stream, line)) {
+            // Remove "data: " prefix if present
+            if (line.substr(0, 6) == "data: ") {
+                line = line.substr(6);
+            }
+            
+            // Skip empty lines and [DONE] marker
+            if (line.empty() || line == "[DONE]") {
+                continue;
+            }
+            
+            // Extract content from JSON line
+            string content = extractContent(line);
+            if (!content.empty()) {
+                string processedContent = callback(content);
+                cout << processedContent;
+                accumulatedResponse += processedContent;
+            }
+        }
+        
+        cout << flush;
+        
+        return accumulatedResponse;
+    }
+};
+
+// Serves many LLM conversations over one config and one curl handle pool.
+// Jobs are taken round-robin across sessions, one at a time per session so
+// the history stays in order, and idle sessions can be parked on disk.
+class SessionManager {
+public:
+    SessionManager(
+        size_t workers = 4, 
+        size_t sessionLimit = 8, 
+        const string& evictDir = ".sessions", 
+        chrono::seconds idleTimeout = chrono::seconds(0),
+        const string& configFile = "config.ini"
+    ):
+        m_configs(make_shared<ConfigStore>(configFile)),
+        m_ownTransport(make_unique<Transport>(workers)),
+        m_transport(m_ownTransport.get()),
+        m_sessionLimit(sessionLimit),
+        m_evictDir(evictDir),
+        m_idleTimeout(idleTimeout)
+    {
+        start(workers);
+    }
+
+    // Serve sessions over the config and transport of an existing LLM
+    SessionManager(
+        shared_ptr<ConfigStore> configs,
+        Transport& transport,
+        size_t workers = 4, 
+        size_t sessionLimit = 8, 
+        const string& evictDir = ".sessions", 
+        chrono::seconds idleTimeout = chrono::seconds(0)
+    ):
+        m_configs(configs),
+        m_transport(&transport),
+        m_sessionLimit(sessionLimit),
+        m_evictDir(evictDir),
+        m_idleTimeout(idleTimeout)
+    {
+        start(workers);
+    }
+
+    virtual ~SessionManager() {
+        {
+            lock_guard<mutex> lock(m_mutex);
+            m_stop = true;
+        }
+        m_wakeup.notify_all();
+        for (thread& worker : m_workers) {
+            worker.join();
+        }
+        // Answer whatever was still queued so no caller waits forever
+        for (auto& [id, session] : m_sessions) {
+            for (Job& job : session->pending) {
+                job.done("");
+            }
+        }
+    }
+
+    // Shared by every session, call watch() on it to pick up config changes without a restart
+    ConfigStore& configs() {
+        return *m_configs;
+    }
+
+    // Queue a prompt for a session (created on first use), the future holds the response
+    future<string> submit(const string& id, const string& prompt) {
+        shared_ptr<promise<string>> result = make_shared<promise<string>>();
+        enqueue(id, prompt, false, [result](const string& response) { result->set_value(response); });
+        return result->get_future();
+    }
+
+    // Same, but done(response) is called once the session is idle again. It runs on
+    // a worker thread with the manager locked, so it must not call back into it.
+    void submit(const string& id, const string& prompt, function<void(const string&)> done) {
+        enqueue(id, prompt, false, done);
+    }
+
+    // Queue a system prompt change, applied in order with the prompts of the session
+    future<string> setSystemPrompt(const string& id, const string& systemPrompt) {
+        shared_ptr<promise<string>> result = make_shared<promise<string>>();
+        enqueue(id, systemPrompt, true, [result](const string& response) { result->set_value(response); });
+        return result->get_future();
+    }
+
+    // Maximum number of queued and running requests for a session
+    void setLimit(const string& id, size_t limit) {
+        unique_lock<mutex> lock(m_mutex);
+        session(lock, id).limit = limit;
+    }
+
+    // Park every session that has been idle for at least maxIdle, returns how many were evicted
+    size_t evictIdle(chrono::seconds maxIdle) {
+        unique_lock<mutex> lock(m_mutex);
+        return evictIdleLocked(lock, maxIdle);
+    }
+
+    bool isEvicted(const string& id) {
+        lock_guard<mutex> lock(m_mutex);
+        auto it = m_sessions.find(id);
+        return it != m_sessions.end() && !it->second->llm;
+    }
+
+    // Forget a session and its parked file, ignored while it still has work
+    void close(const string& id) {
+        lock_guard<mutex> lock(m_mutex);
+        auto it = m_sessions.find(id);
+        if (it == m_sessions.end() || it->second->running || it->second->moving || !it->second->pending.empty()) {
+            return;
+        }
+        filesystem::remove(evictPath(id));
+        m_sessions.erase(it);
+    }
+
+private:
+    struct Job {
+        string text;
+        bool system;
+        function<void(const string&)> done;
+    };
+
+    // Kept small: an evicted session is just its id, an empty queue and a timestamp
+    struct Session {
+        string id;
+        unique_ptr<LLM> llm; // null while evicted to disk
+        vector<Job> pending;
+        size_t limit;
+        bool running = false;
+        bool moving = false; // being parked or restored, its file is in use outside the lock
+        chrono::steady_clock::time_point lastUsed;
+    };
+
+    shared_ptr<ConfigStore> m_configs;
+    unique_ptr<Transport> m_ownTransport; // only set when not shared
+    Transport* m_transport;
+    size_t m_sessionLimit;
+    string m_evictDir;
+    chrono::seconds m_idleTimeout;
+
+    mutex m_mutex;
+    condition_variable m_wakeup;
+    condition_variable m_moved; // a session finished being parked or restored
+    bool m_stop = false;
+    chrono::steady_clock::time_point m_lastSweep = chrono::steady_clock::now();
+    map<string, unique_ptr<Session>> m_sessions;
+    deque<Session*> m_ready; // sessions with pending jobs, served in turn
+    vector<thread> m_workers;
+
+    void start(size_t workers) {
+        for (size_t i = 0; i < (workers ? workers : 1); i++) {
+            m_workers.emplace_back([this] { work(); });
+        }
+    }
+
+    void enqueue(const string& id, const string& text, bool system, function<void(const string&)> done) {
+        {
+            unique_lock<mutex> lock(m_mutex);
+            Session& s = session(lock, id);
+            if (s.pending.size() + (s.running ? 1 : 0) >= s.limit) {
+                cerr << "Session " << id << " is over its limit of " << s.limit << " requests" << endl;
+                done("");
+                return;
+            }
+            s.pending.push_back(Job{text, system, done});
+            if (!s.running && s.pending.size() == 1) {
+                m_ready.push_back(&s);
+            }
+        }
+        m_wakeup.notify_one();
+    }
+
+    // Find or create a session, bringing it back from disk if it was evicted.
+    // The file is read with the lock released, other sessions keep being served meanwhile.
+    Session& session(unique_lock<mutex>& lock, const string& id) {
+        while (true) {
+            unique_ptr<Session>& s = m_sessions[id];
+            if (!s) {
+                s = make_unique<Session>();
+                s->id = id;
+                s->limit = m_sessionLimit;
+            }
+            if (s->moving) {
+                // Look it up again afterwards, it may have been closed meanwhile
+                m_moved.wait(lock);
+                continue;
+            }
+            if (!s->llm) {
+                s->moving = true;
+                lock.unlock();
+                unique_ptr<LLM> llm = restore(id);
+                lock.lock();
+                s->llm = move(llm);
+                s->moving = false;
+                m_moved.notify_all();
+            }
+            s->lastUsed = chrono::steady_clock::now();
+            return *s;
+        }
+    }
+
+    void work() {
+        unique_lock<mutex> lock(m_mutex);
+        while (true) {
+            // Sweep on a schedule, traffic on some sessions must not keep the idle ones in memory
+            if (m_idleTimeout.count() > 0 && chrono::steady_clock::now() - m_lastSweep >= m_idleTimeout) {
+                m_lastSweep = chrono::steady_clock::now();
+                evictIdleLocked(lock, m_idleTimeout);
+            }
+            if (m_ready.empty() && !m_stop) {
+                if (m_idleTimeout.count() > 0) {
+                    m_wakeup.wait_until(lock, m_lastSweep + m_idleTimeout, [this] { return m_stop || !m_ready.empty(); });
+                } else {
+                    m_wakeup.wait(lock, [this] { return m_stop || !m_ready.empty(); });
+                }
+                continue;
+            }
+            if (m_stop) {
+                return;
+            }
+
+            Session& s = *m_ready.front();
+            m_ready.pop_front();
+            Job job = move(s.pending.front());
+            s.pending.erase(s.pending.begin());
+            s.running = true;
+            lock.unlock();
+
+            string response;
+            if (job.system) {
+                s.llm->setSystemPrompt(job.text);
+            } else {
+                response = s.llm->prompt(job.text, false);
+            }
+
+            lock.lock();
+            s.running = false;
+            s.lastUsed = chrono::steady_clock::now();
+            // Back of the line, so busy sessions don't starve the others
+            if (!s.pending.empty()) {
+                m_ready.push_back(&s);
+            }
+            // Answer once the session is idle again, so the caller can close() it right away
+            job.done(response);
+        }
+    }
+
+    // Called with the lock held. Idle sessions are marked as moving so nobody touches
+    // them, then written out with the lock released and dropped from memory once saved.
+    size_t evictIdleLocked(unique_lock<mutex>& lock, chrono::seconds maxIdle) {
+        chrono::steady_clock::time_point now = chrono::steady_clock::now();
+        vector<Session*> idle;
+        for (auto& [id, s] : m_sessions) {
+            if (!s->llm || s->running || s->moving || !s->pending.empty() || now - s->lastUsed < maxIdle) {
+                continue;
+            }
+            s->moving = true;
+            idle.push_back(s.get());
+        }
+        if (idle.empty()) {
+            return 0;
+        }
+        
+        lock.unlock();
+        vector<bool> parked;
+        for (Session* s : idle) {
+            parked.push_back(park(s->id, *s->llm));
+        }
+        lock.lock();
+        
+        size_t evicted = 0;
+        for (size_t i = 0; i < idle.size(); i++) {
+            if (parked[i]) {
+                idle[i]->llm.reset();
+                idle[i]->pending.shrink_to_fit();
+                evicted++;
+            }
+            idle[i]->moving = false;
+        }
+        m_moved.notify_all();
+        return evicted;
+    }
+
+    // Write a session to a temporary file and rename it, a crash never leaves a truncated one
+    bool park(const string& id, const LLM& llm) {
+        error_code ec;
+        filesystem::create_directories(m_evictDir, ec);
+        string path = evictPath(id);
+        string tmp = path + ".tmp";
+        ofstream file(tmp);
+        if (!file.is_open()) {
+            cerr << "Error: Could not evict session " << id << endl;
+            return false;
+        }
+        llm.save(file);
+        file.close();
+        if (!file || rename(tmp.c_str(), path.c_str()) != 0) {
+            cerr << "Error: Could not evict session " << id << endl;
+            remove(tmp.c_str());
+            return false;
+        }
+        return true;
+    }
+
+    unique_ptr<LLM> restore(const string& id) {
+        unique_ptr<LLM> llm = make_unique<LLM>(m_configs, *m_transport);
+        string path = evictPath(id);
+        ifstream file(path);
+        if (!file.is_open()) {
+            return llm; // new session
+        }
+        bool loaded = llm->load(file);
+        file.close();
+        if (!loaded) {
+            // Keep the history aside instead of losing it for good
+            cerr << "Error: Could not restore session " << id << " from " << path << ", kept as " << path << ".bad" << endl;
+            error_code ec;
+            filesystem::rename(path, path + ".bad", ec);
+            return make_unique<LLM>(m_configs, *m_transport);
+        }
+        filesystem::remove(path);
+        return llm;
+    }
+
+    // Session ids come from callers, hex them so any id is a safe file name.
+    // Long ids keep a hex prefix plus a hash of the whole id to stay under NAME_MAX.
+    string evictPath(const string& id) const {
+        static const char* digits = "0123456789abcdef";
+        static const size_t maxPrefix = 64;
+        string name;
+        for (size_t i = 0; i < id.size() && i < maxPrefix; i++) {
+            unsigned char c = id[i];
+            name += digits[c >> 4];
+            name += digits[c & 15];
+        }
+        if (id.size() > maxPrefix) {
+            // FNV-1a, stable across builds unlike std::hash
+            uint64_t hash = 0xcbf29ce484222325ull;
+            for (unsigned char c : id) {
+                hash = (hash ^ c) * 0x100000001b3ull;
+            }
+            name += "-";
+            for (int shift = 60; shift >= 0; shift -= 4) {
+                name += digits[(hash >> shift) & 15];
+            }
+        }
+        return m_evictDir + "/" + name + ".session";
+    }
+};
+
+// Runs one prompt over a file too large for a single context: the file is
+// mapped, cut into overlapping chunks on line or sentence boundaries, every
+// chunk is prompted as its own conversation through a SessionManager and the
+// answers are reduced in rounds of fanIn until one is left.
+class MapReduce {
+public:
+    MapReduce(
+        SessionManager& pool, 
+        size_t concurrency = 8, 
+        size_t chunkSize = 8000, 
+        size_t overlap = 400, 
+        size_t fanIn = 8, 
+        size_t retries = 2
+    ):
+        m_pool(pool),
+        m_concurrency(concurrency ? concurrency : 1),
+        m_chunkSize(chunkSize ? chunkSize : 1),
+        m_overlap(overlap < chunkSize ? overlap : chunkSize / 2),
+        m_fanIn(fanIn > 1 ? fanIn : 2),
+        m_retries(retries) {}
+
+    virtual ~MapReduce() {}
+
+    string run(const string& filename, const string& mapPrompt, const string& reducePrompt) {
+        int fd = open(filename.c_str(), O_RDONLY);
+        if (fd < 0) {
+            cerr << "Error: Could not open file " << filename << endl;
+            return "";
+        }
+        struct stat st;
+        if (fstat(fd, &st) != 0 || st.st_size == 0) {
+            close(fd);
+            return "";
+        }
+        size_t size = (size_t)st.st_size;
+        void* mapped = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (mapped == MAP_FAILED) {
+            cerr << "Error: Could not map file " << filename << endl;
+            return "";
+        }
+        const char* data = (const char*)mapped;
+        madvise(mapped, size, MADV_SEQUENTIAL);
+
+        // An answer missing any part of the document is no answer, give up on the first stage that fails
+        vector<pair<size_t, size_t>> chunks = split(data, size, m_chunkSize, m_overlap);
+        vector<string> answers;
+        bool complete = fanOut("map", chunks.size(), [&](size_t i) {
+            return mapPrompt + "\n\n" + string(data + chunks[i].first, chunks[i].second - chunks[i].first);
+        }, answers);
+        munmap(mapped, size);
+
+        // Reduce in rounds, each round merges groups of up to fanIn answers
+        while (complete && answers.size() > 1) {
+            size_t groups = (answers.size() + m_fanIn - 1) / m_fanIn;
+            vector<string> reduced;
+            complete = fanOut("reduce", groups, [&](size_t i) {
+                string prompt = reducePrompt;
+                for (size_t j = i * m_fanIn; j < min(answers.size(), (i + 1) * m_fanIn); j++) {
+                    prompt += "\n\n" + answers[j];
+                }
+                return prompt;
+            }, reduced);
+            answers = reduced;
+        }
+        return complete && !answers.empty() ? answers[0] : "";
+    }
+
+    // Cut data into [start, end) ranges of at most chunkSize bytes, ending
+    // after a newline or sentence end where one is found in the second half
+    // of the chunk, each range starting overlap bytes before the previous end
+    static vector<pair<size_t, size_t>> split(const char* data, size_t size, size_t chunkSize, size_t overlap) {
+        vector<pair<size_t, size_t>> chunks;
+        size_t start = 0;
+        while (start < size) {
+            size_t end = min(size, start + chunkSize);
+            if (end < size) {
+                for (size_t i = end; i > start + chunkSize / 2; i--) {
+                    if (isBoundary(data, size, i - 1)) {
+                        end = i;
+                        break;
+                    }
+                }
+            }
+            chunks.push_back({ start, end });
+            if (end == size) {
+                break;
+            }
+            
+            // Start the next chunk at a boundary inside the overlap if there is one
+            size_t next = end > start + overlap ? end - overlap : start + 1;
+            for (size_t i = next; i + 1 < end; i++) {
+                if (isBoundary(data, size, i)) {
+                    next = i + 1;
+                    break;
+                }
+            }
+            start = max(next, start + 1);
+        }
+        return chunks;
+    }
+
+private:
+    SessionManager& m_pool;
+    size_t m_concurrency;
+    size_t m_chunkSize;
+    size_t m_overlap;
+    size_t m_fanIn;
+    size_t m_retries;
+
+    static bool isBoundary(const char* data, size_t size, size_t i) {
+        char c = data[i];
+        if (c == '\n') {
+            return true;
+        }
+        return (c == '.' || c == '!' || c == '?') && i + 1 < size && isspace((unsigned char)data[i + 1]);
+    }
+
+    // Send count prompts with at most m_concurrency in flight, a failed (empty)
+    // answer is retried in a later round without resending the others.
+    // Returns false if some prompt still failed after the last retry.
+    bool fanOut(const string& stage, size_t count, function<string(size_t)> prompt, vector<string>& answers) {
+        answers.assign(count, "");
+        vector<size_t> todo;
+        for (size_t i = 0; i < count; i++) {
+            todo.push_back(i);
+        }
+        // Session ids must not meet those of another run on a shared pool, or a file parked by an earlier process
+        static atomic<size_t> runs(0);
+        static const string process = to_string(getpid()) + "-" + to_string(random_device()());
+        string prefix = "mapreduce-" + process + "-" + to_string(runs++) + "-" + stage + "-";
+        
+        // Answers are taken in the order they finish, so a slow prompt holds up only its own slot
+        mutex finishedMutex;
+        condition_variable finishedCond;
+        deque<pair<size_t, string>> finished;
+        
+        chrono::steady_clock::time_point started = chrono::steady_clock::now();
+        size_t done = 0;
+        size_t bytes = 0;
+        size_t step = max((size_t)1, count / 10);
+        for (size_t attempt = 0; attempt <= m_retries && !todo.empty(); attempt++) {
+            if (attempt > 0) {
+                cout << "Retrying " << todo.size() << " failed " << stage << " prompt(s)" << endl;
+            }
+            vector<size_t> failed;
+            size_t inflight = 0;
+            size_t next = 0;
+            while (next < todo.size() || inflight > 0) {
+                while (next < todo.size() && inflight < m_concurrency) {
+                    size_t i = todo[next++];
+                    string text = prompt(i);
+                    bytes += text.size();
+                    inflight++;
+                    m_pool.submit(prefix + to_string(i), text, [i, &finishedMutex, &finishedCond, &finished](const string& answer) {
+                        lock_guard<mutex> lock(finishedMutex);
+                        finished.push_back({ i, answer });
+                        finishedCond.notify_one();
+                    });
+                }
+                
+                unique_lock<mutex> lock(finishedMutex);
+                finishedCond.wait(lock, [&finished] { return !finished.empty(); });
+                auto [i, answer] = finished.front();
+                finished.pop_front();
+                lock.unlock();
+                inflight--;
+                
+                m_pool.close(prefix + to_string(i));
+                if (answer.empty()) {
+                    failed.push_back(i);
+                    continue;
+                }
+                answers[i] = answer;
+                done++;
+                if (done % step == 0 || done == count) {
+                    double seconds = chrono::duration<double>(chrono::steady_clock::now() - started).count();
+                    cout << stage << ": " << done << "/" << count << " done, " 
+                         << (size_t)(done / seconds) << " prompts/s, " 
+                         << (size_t)(bytes / 1024 / seconds) << " KB/s sent" << endl;
+                }
+            }
+            todo = failed;
+        }
+        
+        if (!todo.empty()) {
+            cerr << "Error: " << todo.size() << " " << stage << " prompt(s) failed after " << m_retries << " retries" << endl;
+            return false;
+        }
+        return true;
+    }
+};
+
+// Client for the OpenAI compatible /v1/embeddings endpoint
+class Embeddings {
+public:
+    Embeddings():
+        m_configs(make_shared<ConfigStore>()), 
+        m_ownTransport(make_unique<Transport>()), 
+        m_transport(m_ownTransport.get()) {}
+
+    Embeddings(shared_ptr<ConfigStore> configs, Transport& transport):
+        m_configs(configs), 
+        m_transport(&transport) {}
+
+    virtual ~Embeddings() {}
+
+    // Embed inputs with batchSize inputs per request, empty if any batch fails
+    vector<vector<float>> embed(const vector<string>& inputs, size_t batchSize = 64) {
+        vector<vector<float>> embeddings;
+        shared_ptr<const LLMConfig> config = m_configs->snapshot();
+        batchSize = batchSize ? batchSize : 1;
+        for (size_t start = 0; start < inputs.size(); start += batchSize) {
+            size_t end = min(inputs.size(), start + batchSize);
+            string response = m_transport->post(
+                config->embeddingsEndpoint, buildJsonRequest(*config, inputs, start, end), 
+                config->timeout, config->connectTimeout
+            );
+            vector<vector<float>> batch = extractEmbeddings(response);
+            if (batch.size() != end - start) {
+                cerr << "Error: Embeddings request returned " << batch.size() << " of " << end - start << " vectors" << endl;
+                return {};
+            }
+            for (vector<float>& embedding : batch) {
+                embeddings.push_back(move(embedding));
+            }
+        }
+        return embeddings;
+    }
+
+    vector<float> embed(const string& input) {
+        vector<vector<float>> embeddings = embed(vector<string>{ input });
+        return embeddings.empty() ? vector<float>() : embeddings[0];
+    }
+
+private:
+    shared_ptr<ConfigStore> m_configs;
+    unique_ptr<Transport> m_ownTransport; // only set when not shared
+    Transport* m_transport;
+
+    string buildJsonRequest(const LLMConfig& config, const vector<string>& inputs, size_t start, size_t end) {
+        stringstream ss;
+        ss << "{";
+        ss << "\"model\": \"" << escapeJson(config.embeddingsModel) << "\",";
+        ss << "\"input\": [";
+        for (size_t i = start; i < end; i++) {
+            ss << (i > start ? "," : "") << "\"" << escapeJson(inputs[i]) << "\"";
+        }
+        ss << "]}";
+        return ss.str();
+    }
+
+    // Collect every "embedding": [...] array of the response, in order
+    vector<vector<float>> extractEmbeddings(const string& json) {
+        vector<vector<float>> embeddings;
+        size_t pos = 0;
+        while ((pos = json.find("\"embedding\"", pos)) != string::npos) {
+            pos += 11;
+            size_t colonPos = json.find_first_not_of(" \t\r\n", pos);
+            if (colonPos == string::npos || json[colonPos] != ':') {
+                continue; // "object": "embedding"
+            }
+            size_t openPos = json.find_first_not_of(" \t\r\n", colonPos + 1);
+            if (openPos == string::npos || json[openPos] != '[') {
+                continue;
+            }
+            
+            vector<float> embedding;
+            const char* p = json.c_str() + openPos + 1;
+            while (true) {
+                while (*p == ' ' || *p == ',' || *p == '\n' || *p == '\r' || *p == '\t') {
+                    p++;
+                }
+                if (*p == ']' || *p == '\0') {
+                    break;
+                }
+                char* next;
+                float value = strtof(p, &next);
+                if (next == p) {
+                    break;
+                }
+                embedding.push_back(value);
+                p = next;
+            }
+            pos = p - json.c_str();
+            embeddings.push_back(move(embedding));
+        }
+        return embeddings;
+    }
+};
+
+// Index of normalized vectors searched by dot product, i.e. cosine similarity.
+// searchFlat() is an exact brute force scan, search() walks the HNSW graph when
+// one is built. save() writes a single file that load() maps back without parsing.
+class VectorIndex {
+public:
+    VectorIndex(size_t dim = 0, bool hnsw = true, size_t M = 16, size_t efConstruction = 200):
+        m_dim(dim),
+        m_hnsw(hnsw),
+        m_M(M > 1 ? M : 2),
+        m_efConstruction(efConstruction),
+        m_ef(64),
+        m_levelMult(1.0 / log((double)m_M)),
+        m_random(42) 
+    {
+        refresh();
+    }
+
+    virtual ~VectorIndex() {
+        unmap();
+    }
+
+    VectorIndex(const VectorIndex&) = delete;
+    VectorIndex& operator=(const VectorIndex&) = delete;
+
+    size_t size() const {
+        return m_count;
+    }
+
+    size_t dim() const {
+        return m_dim;
+    }
+
+    // Candidate list size of HNSW queries, higher is slower with better recall
+    void setEf(size_t ef) {
+        m_ef = ef;
+    }
+
+    // Add a vector with the text it was embedded from, returns its id
+    uint32_t add(const vector<float>& vec, const string& text) {
+        if (m_dim == 0 && m_count == 0) {
+            m_dim = vec.size();
+        }
+        if (vec.size() != m_dim || m_dim == 0) {
+            cerr << "Error: Vector of size " << vec.size() << " added to index of dimension " << m_dim << endl;
+            return NONE;
+        }
+        if (m_mapped) {
+            materialize();
+        }
+        
+        uint32_t id = (uint32_t)m_count;
+        float norm = sqrt(dot(vec.data(), vec.data(), m_dim));
+        for (float value : vec) {
+            m_vectorData.push_back(norm > 0 ? value / norm : 0);
+        }
+        m_textData += text;
+        m_textOffsetData.push_back(m_textData.size());
+        m_count++;
+        refresh();
+        
+        if (m_hnsw) {
+            insert(id);
+        }
+        return id;
+    }
+
+    string text(uint32_t id) const {
+        if (id >= m_count) {
+            return "";
+        }
+        return string(m_texts + m_textOffsets[id], m_textOffsets[id + 1] - m_textOffsets[id]);
+    }
+
+    // Top k (id, similarity) pairs, best first
+    vector<pair<uint32_t, float>> search(const vector<float>& query, size_t k) const {
+        if (!m_hnsw || m_count == 0 || query.size() != m_dim) {
+            return searchFlat(query, k);
+        }
+        vector<float> q = normalized(query);
+        
+        // Greedy descent through the upper levels, then a wide search at level 0
+        uint32_t cur = m_entry;
+        float curSim = dot(q.data(), vec(cur), m_dim);
+        for (size_t level = m_maxLevel; level > 0; level--) {
+            cur = greedy(q.data(), cur, curSim, level);
+        }
+        vector<pair<float, uint32_t>> found = searchLayer(q.data(), cur, max(m_ef, k), 0);
+        
+        vector<pair<uint32_t, float>> results;
+        for (size_t i = 0; i < found.size() && i < k; i++) {
+            results.push_back({ found[i].second, found[i].first });
+        }
+        return results;
+    }
+
+    vector<pair<uint32_t, float>> searchFlat(const vector<float>& query, size_t k) const {
+        vector<pair<uint32_t, float>> results;
+        if (query.size() != m_dim || k == 0) {
+            return results;
+        }
+        vector<float> q = normalized(query);
+        
+        // Min-heap of the best k so far
+        priority_queue<pair<float, uint32_t>, vector<pair<float, uint32_t>>, greater<pair<float, uint32_t>>> best;
+        for (size_t id = 0; id < m_count; id++) {
+            float sim = dot(q.data(), m_vectors + id * m_dim, m_dim);
+            if (best.size() < k) {
+                best.push({ sim, (uint32_t)id });
+            } else if (sim > best.top().first) {
+                best.pop();
+                best.push({ sim, (uint32_t)id });
+            }
+        }
+        results.resize(best.size());
+        for (size_t i = results.size(); i > 0; i--) {
+            results[i - 1] = { best.top().second, best.top().first };
+            best.pop();
+        }
+        return results;
+    }
+
+    // Written next to the target and renamed over it, so an index mapped from
+    // the same path (by this or another process) is never truncated under a reader
+    bool save(const string& filename) const {
+        string tmpname = filename + ".tmp";
+        ofstream file(tmpname, ios::binary);
+        if (!file.is_open()) {
+            cerr << "Error: Could not open file " << tmpname << endl;
+            return false;
+        }
+        Header header = makeHeader();
+        Layout layout;
+        makeLayout(header, layout);
+        file.write((const char*)&header, sizeof(header));
+        size_t nodes = m_hnsw ? m_count : 0;
+        writeSection(file, layout.vectors, m_vectors, m_count * m_dim * sizeof(float));
+        writeSection(file, layout.links, m_links, nodes * 2 * m_M * sizeof(uint32_t));
+        writeSection(file, layout.levels, m_levels, nodes);
+        writeSection(file, layout.upperOffsets, m_upperOffsets, nodes * sizeof(uint64_t));
+        writeSection(file, layout.upperLinks, m_upperLinks, header.upperLinks * sizeof(uint32_t));
+        writeSection(file, layout.textOffsets, m_textOffsets, (m_count + 1) * sizeof(uint64_t));
+        writeSection(file, layout.texts, m_texts, header.textBytes);
+        file.close();
+        if (!file || rename(tmpname.c_str(), filename.c_str()) != 0) {
+            cerr << "Error: Could not write file " << filename << endl;
+            remove(tmpname.c_str());
+            return false;
+        }
+        return true;
+    }
+
+    // Map an index written by save(), adding to it afterwards copies it into memory.
+    // Links and text offsets are checked once here, searches trust them afterwards.
+    bool load(const string& filename) {
+        int fd = open(filename.c_str(), O_RDONLY);
+        if (fd < 0) {
+            cerr << "Error: Could not open file " << filename << endl;
+            return false;
+        }
+        struct stat st;
+        if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(Header)) {
+            close(fd);
+            cerr << "Error: Invalid index file " << filename << endl;
+            return false;
+        }
+        size_t size = (size_t)st.st_size;
+        void* mapped = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+        if (mapped == MAP_FAILED) {
+            cerr << "Error: Could not map file " << filename << endl;
+            return false;
+        }
+        
+        const char* data = (const char*)mapped;
+        Header header;
+        memcpy(&header, data, sizeof(header));
+        Layout layout;
+        if (!validHeader(header) || !makeLayout(header, layout) || layout.end > size || !validSections(header, layout, data)) {
+            munmap(mapped, size);
+            cerr << "Error: Invalid index file " << filename << endl;
+            return false;
+        }
+        
+        unmap();
+        clear();
+        m_mapped = mapped;
+        m_mappedSize = size;
+        m_dim = header.dim;
+        m_count = header.count;
+        m_M = header.M;
+        m_hnsw = header.hnsw;
+        m_maxLevel = header.maxLevel;
+        m_entry = (uint32_t)header.entry;
+        m_upperLinkCount = header.upperLinks;
+        m_levelMult = 1.0 / log((double)m_M);
+        m_vectors = (const float*)(data + layout.vectors);
+        m_links = (const uint32_t*)(data + layout.links);
+        m_levels = (const uint8_t*)(data + layout.levels);
+        m_upperOffsets = (const uint64_t*)(data + layout.upperOffsets);
+        m_upperLinks = (const uint32_t*)(data + layout.upperLinks);
+        m_textOffsets = (const uint64_t*)(data + layout.textOffsets);
+        m_texts = data + layout.texts;
+        return true;
+    }
+
+    // Dot product, 16 floats per step with AVX2 and FMA when compiled with them
+    static float dot(const float* a, const float* b, size_t dim) {
+        size_t i = 0;
+        float sum = 0;
+#if defined(__AVX2__) && defined(__FMA__)
+        __m256 sum0 = _mm256_setzero_ps();
+        __m256 sum1 = _mm256_setzero_ps();
+        for (; i + 16 <= dim; i += 16) {
+            sum0 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i), sum0);
+            sum1 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i + 8), _mm256_loadu_ps(b + i + 8), sum1);
+        }
+        for (; i + 8 <= dim; i += 8) {
+            sum0 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i), sum0);
+        }
+        sum0 = _mm256_add_ps(sum0, sum1);
+        __m128 half = _mm_add_ps(_mm256_castps256_ps128(sum0), _mm256_extractf128_ps(sum0, 1));
+        half = _mm_hadd_ps(half, half);
+        half = _mm_hadd_ps(half, half);
+        sum = _mm_cvtss_f32(half);
+#else
+        // Independent accumulators so the compiler can vectorize the loop
+        float sums[4] = { 0, 0, 0, 0 };
+        for (; i + 4 <= dim; i += 4) {
+            sums[0] += a[i] * b[i];
+            sums[1] += a[i + 1] * b[i + 1];
+            sums[2] += a[i + 2] * b[i + 2];
+            sums[3] += a[i + 3] * b[i + 3];
+        }
+        sum = (sums[0] + sums[1]) + (sums[2] + sums[3]);
+#endif
+        for (; i < dim; i++) {
+            sum += a[i] * b[i];
+        }
+        return sum;
+    }
+
+private:
+    static constexpr uint32_t NONE = UINT32_MAX;
+    static constexpr char MAGIC[8] = { 'V', 'I', 'D', 'X', '0', '0', '0', '1' };
+
+    struct Header {
+        char magic[8];
+        uint64_t dim;
+        uint64_t count;
+        uint64_t M;
+        uint64_t hnsw;
+        uint64_t maxLevel;
+        uint64_t entry;
+        uint64_t upperLinks;
+        uint64_t textBytes;
+    };
+
+    // Byte offsets of the sections in the file, each 8 byte aligned
+    struct Layout {
+        size_t vectors;
+        size_t links;
+        size_t levels;
+        size_t upperOffsets;
+        size_t upperLinks;
+        size_t textOffsets;
+        size_t texts;
+        size_t end;
+    };
+
+    size_t m_dim;
+    bool m_hnsw;
+    size_t m_M;
+    size_t m_efConstruction;
+    size_t m_ef;
+    double m_levelMult;
+    mt19937 m_random;
+    size_t m_count = 0;
+    size_t m_maxLevel = 0;
+    uint32_t m_entry = NONE;
+
+    // Built in memory...
+    vector<float> m_vectorData;
+    vector<uint32_t> m_linkData;      // 2M level 0 neighbors per node
+    vector<uint8_t> m_levelData;
+    vector<uint64_t> m_upperOffsetData; // into m_upperLinkData, M per level above 0
+    vector<uint32_t> m_upperLinkData;
+    vector<uint64_t> m_textOffsetData = { 0 };
+    string m_textData;
+    size_t m_upperLinkCount = 0;
+
+    // ...or mapped from a file, searches only read through these
+    void* m_mapped = nullptr;
+    size_t m_mappedSize = 0;
+    const float* m_vectors = nullptr;
+    const uint32_t* m_links = nullptr;
+    const uint8_t* m_levels = nullptr;
+    const uint64_t* m_upperOffsets = nullptr;
+    const uint32_t* m_upperLinks = nullptr;
+    const uint64_t* m_textOffsets = nullptr;
+    const char* m_texts = nullptr;
+
+    const float* vec(uint32_t id) const {
+        return m_vectors + (size_t)id * m_dim;
+    }
+
+    size_t maxLinks(size_t level) const {
+        return level == 0 ? 2 * m_M : m_M;
+    }
+
+    const uint32_t* links(uint32_t id, size_t level) const {
+        return level == 0 
+            ? m_links + (size_t)id * 2 * m_M 
+            : m_upperLinks + m_upperOffsets[id] + (level - 1) * m_M;
+    }
+
+    uint32_t* mutableLinks(uint32_t id, size_t level) {
+        return level == 0 
+            ? m_linkData.data() + (size_t)id * 2 * m_M 
+            : m_upperLinkData.data() + m_upperOffsetData[id] + (level - 1) * m_M;
+    }
+
+    vector<float> normalized(const vector<float>& values) const {
+        float norm = sqrt(dot(values.data(), values.data(), values.size()));
+        vector<float> result(values);
+        for (float& value : result) {
+            value = norm > 0 ? value / norm : 0;
         }
-        curl_global_cleanup();
+        return result;
     }
 
-    // TODO: update system prompt 
-    void setSystemPrompt(const string& systemPrompt) {
-        this->systemPrompt = systemPrompt;
-        // Add system prompt as first message in history
-        chatHistory.clear();
-        chatHistory.push_back(Message{"system", systemPrompt});
+    // Point the read pointers at the in-memory arrays after they grew
+    void refresh() {
+        m_vectors = m_vectorData.data();
+        m_links = m_linkData.data();
+        m_levels = m_levelData.data();
+        m_upperOffsets = m_upperOffsetData.data();
+        m_upperLinks = m_upperLinkData.data();
+        m_textOffsets = m_textOffsetData.data();
+        m_texts = m_textData.data();
+        m_upperLinkCount = m_upperLinkData.size();
     }
-    
-    // TODO: implement completion, update the history, return the inference - if show: show the incoming stream as is on stdout - use prompt with a callback to show as it comes
-    string prompt(const string& prompt, bool show = true) {
-        // Add user prompt to history
-        chatHistory.push_back(Message{"user", prompt});
-        
-        // Build JSON request
-        string requestBody = buildJsonRequest(prompt, false);
-        
-        // Make API call
-        string responseText = makeApiCall(requestBody);
-        
-        if (show) {
-            cout << responseText << endl;
+
+    void clear() {
+        m_vectorData.clear();
+        m_linkData.clear();
+        m_levelData.clear();
+        m_upperOffsetData.clear();
+        m_upperLinkData.clear();
+        m_textOffsetData = { 0 };
+        m_textData.clear();
+        refresh();
+    }
+
+    // Copy a mapped index into memory so it can grow
+    void materialize() {
+        m_vectorData.assign(m_vectors, m_vectors + m_count * m_dim);
+        if (m_hnsw) {
+            m_linkData.assign(m_links, m_links + m_count * 2 * m_M);
+            m_levelData.assign(m_levels, m_levels + m_count);
+            m_upperOffsetData.assign(m_upperOffsets, m_upperOffsets + m_count);
+            m_upperLinkData.assign(m_upperLinks, m_upperLinks + m_upperLinkCount);
         }
-        
-        // Add assistant response to history
-        chatHistory.push_back(Message{"assistant", responseText});
-        
-        return responseText;
+        m_textOffsetData.assign(m_textOffsets, m_textOffsets + m_count + 1);
+        m_textData.assign(m_texts, m_textOffsets[m_count]);
+        unmap();
+        refresh();
     }
 
-    // TODO: same as prompt above but using stream response and calls callback on chuncks for further processing. - note: callback can override chunks if necessary
-    string prompt(const string& prompt, function<string(string)> callback) {
-        // Add user prompt to history
-        chatHistory.push_back(Message{"user", prompt});
-        
-        // Build JSON request with streaming enabled
-        string requestBody = buildJsonRequest(prompt, true);
-        
-        // Make API call with streaming
-        string responseText = makeApiCallStreaming(requestBody, callback);
-        
-        // Add assistant response to history
-        chatHistory.push_back(Message{"assistant", responseText});
-        
-        return responseText;
+    void unmap() {
+        if (m_mapped) {
+            munmap(m_mapped, m_mappedSize);
+            m_mapped = nullptr;
+            m_mappedSize = 0;
+        }
     }
 
-protected:
+    Header makeHeader() const {
+        Header header;
+        memcpy(header.magic, MAGIC, sizeof(header.magic));
+        header.dim = m_dim;
+        header.count = m_count;
+        header.M = m_M;
+        header.hnsw = m_hnsw;
+        header.maxLevel = m_maxLevel;
+        header.entry = m_entry;
+        header.upperLinks = m_hnsw ? m_upperLinkCount : 0;
+        header.textBytes = m_count ? m_textOffsets[m_count] : 0;
+        return header;
+    }
 
-    struct Message {
-        string role;
-        string text;
-        // TODO: feel free to change the Message if necessary
-    };
+    static size_t align(size_t offset) {
+        return (offset + 7) & ~(size_t)7;
+    }
 
-    string systemPrompt; // TODO: store spec system prompts if necessary
-    vector<Message> chatHistory; // TODO: store history here
-    
-private:
-    CURL* m_curl;
-    string m_apiEndpoint;
-    
-    // Load configuration from INI file
-    void loadConfig() {
-        IniFile ini;
-        ini.load(string("config.ini"));
-        m_apiEndpoint = ini.getopt<string>("api_endpoint", "http://localhost:11434/v1/chat/completions", "llm");
+    // Values a search would trust without further checks
+    static bool validHeader(const Header& header) {
+        if (memcmp(header.magic, MAGIC, sizeof(header.magic)) != 0 || header.hnsw > 1 || header.count >= NONE) {
+            return false;
+        }
+        if (header.count > 0 && header.dim == 0) {
+            return false;
+        }
+        if (header.hnsw && (header.M < 2 || header.maxLevel > 255 || (header.count > 0 && header.entry >= header.count))) {
+            return false;
+        }
+        return true;
     }
-    
-    // Build JSON request for OpenAI-compatible API
-    string buildJsonRequest(const string& prompt, bool stream) {
-        stringstream ss;
-        ss << "{";
-        ss << "\"model\": \"llama3\",";
-        ss << "\"stream\": " << (stream ? "true" : "false") << ",";
-        ss << "\"messages\": [";
-        
-        // Add system message if available
-        if (!systemPrompt.empty()) {
-            ss << "{\"role\": \"system\", \"content\": \"" << escapeJson(systemPrompt) << "\"},";
+
+    // Every link points at a node that exists on its level, every text lies inside the texts section
+    static bool validSections(const Header& header, const Layout& layout, const char* data) {
+        const uint64_t* textOffsets = (const uint64_t*)(data + layout.textOffsets);
+        if (textOffsets[0] != 0 || textOffsets[header.count] != header.textBytes) {
+            return false;
         }
-        
-        // Add chat history
-        for (size_t i = 0; i < chatHistory.size(); i++) {
-            const Message& msg = chatHistory[i];
-            ss << "{\"role\": \"" << msg.role << "\", \"content\": \"" << escapeJson(msg.text) << "\"}";
-            if (i < chatHistory.size() - 1 || msg.role == "user") {
-                ss << ",";
+        for (size_t id = 0; id < header.count; id++) {
+            if (textOffsets[id] > textOffsets[id + 1]) {
+                return false;
             }
         }
+        if (!header.hnsw || header.count == 0) {
+            return true;
+        }
         
-        // Add user prompt
-        ss << "{\"role\": \"user\", \"content\": \"" << escapeJson(prompt) << "\"}";
-        
-        ss << "]}";
-        
-        return ss.str();
-    }
-    
-    // Escape JSON special characters
-    string escapeJson(const string& str) {
-        string result;
-        for (char c : str) {
-            switch (c) {
-                case '"': result += "\\\""; break;
-                case '\\': result += "\\\\"; break;
-                case '\b': result += "\\b"; break;
-                case '\f': result += "\\f"; break;
-                case '\n': result += "\\n"; break;
-                case '\r': result += "\\r"; break;
-                case '\t': result += "\\t"; break;
-                default: result += c; break;
+        const uint32_t* links = (const uint32_t*)(data + layout.links);
+        const uint8_t* levels = (const uint8_t*)(data + layout.levels);
+        const uint64_t* upperOffsets = (const uint64_t*)(data + layout.upperOffsets);
+        const uint32_t* upperLinks = (const uint32_t*)(data + layout.upperLinks);
+        if (levels[header.entry] != header.maxLevel) {
+            return false;
+        }
+        for (size_t id = 0; id < header.count; id++) {
+            size_t level = levels[id];
+            if (level > header.maxLevel || upperOffsets[id] > header.upperLinks 
+                || level * header.M > header.upperLinks - upperOffsets[id]) {
+                return false;
+            }
+            for (size_t l = 0; l <= level; l++) {
+                const uint32_t* neighbors = l == 0 
+                    ? links + id * 2 * header.M 
+                    : upperLinks + upperOffsets[id] + (l - 1) * header.M;
+                for (size_t i = 0; i < (l == 0 ? 2 * header.M : header.M); i++) {
+                    if (neighbors[i] != NONE && (neighbors[i] >= header.count || levels[neighbors[i]] < l)) {
+                        return false;
+                    }
+                }
             }
         }
-        return result;
+        return true;
     }
-    
-    // Callback for curl to write response data
-    static size_t writeCallback(void* contents, size_t size, size_t nmemb, void* userp) {
-        ((string*)userp)->append((char*)contents, size * nmemb);
-        return size * nmemb;
+
+    // Add a * b * c bytes to offset, false on overflow
+    static bool advance(size_t& offset, uint64_t a, uint64_t b, uint64_t c = 1) {
+        uint64_t size;
+        return !__builtin_mul_overflow(a, b, &size) 
+            && !__builtin_mul_overflow(size, c, &size) 
+            && !__builtin_add_overflow(offset, size, &offset);
     }
-    
-    // Extract content from JSON response
-    string extractContent(const string& json) {
-        // Simple JSON parsing - look for "content" field
-        size_t contentPos = json.find("\"content\"");
-        if (contentPos == string::npos) {
-            return "";
+
+    static bool alignUp(size_t& offset) {
+        if (offset > SIZE_MAX - 7) {
+            return false;
         }
-        
-        // Find the value after "content"
-        size_t colonPos = json.find(":", contentPos);
-        if (colonPos == string::npos) {
-            return "";
+        offset = align(offset);
+        return true;
+    }
+
+    // Section offsets for the sizes in header, false if they overflow
+    static bool makeLayout(const Header& header, Layout& layout) {
+        uint64_t links = header.hnsw ? header.count : 0;
+        size_t offset = align(sizeof(Header));
+        layout.vectors = offset;
+        if (!advance(offset, header.count, header.dim, sizeof(float)) || !alignUp(offset)) {
+            return false;
         }
-        
-        // Find the opening quote
-        size_t quotePos = json.find("\"", colonPos);
-        if (quotePos == string::npos) {
-            return "";
+        layout.links = offset;
+        if (!advance(offset, links, header.M, 2 * sizeof(uint32_t)) || !alignUp(offset)) {
+            return false;
         }
-        
-        // Find the closing quote (simple approach - may not handle all cases)
-        size_t closeQuotePos = json.find("\"", quotePos + 1);
-        if (closeQuotePos == string::npos) {
-            return "";
+        layout.levels = offset;
+        if (!advance(offset, links, 1) || !alignUp(offset)) {
+            return false;
         }
-        
-        return json.substr(quotePos + 1, closeQuotePos - quotePos - 1);
+        layout.upperOffsets = offset;
+        if (!advance(offset, links, sizeof(uint64_t)) || !alignUp(offset)) {
+            return false;
+        }
+        layout.upperLinks = offset;
+        if (!advance(offset, header.upperLinks, sizeof(uint32_t)) || !alignUp(offset)) {
+            return false;
+        }
+        layout.textOffsets = offset;
+        if (!advance(offset, header.count + 1, sizeof(uint64_t))) {
+            return false;
+        }
+        layout.texts = offset;
+        if (!advance(offset, header.textBytes, 1)) {
+            return false;
+        }
+        layout.end = offset;
+        return true;
     }
-    
-    // Make API call without streaming
-    string makeApiCall(const string& requestBody) {
-        string response;
-        
-        curl_easy_setopt(m_curl, CURLOPT_URL, m_apiEndpoint.c_str());
-        curl_easy_setopt(m_curl, CURLOPT_POST, 1L);
-        
-        // Set headers
-        struct curl_slist* headers = nullptr;
-        headers = curl_slist_append(headers, "Content-Type: application/json");
-        curl_easy_setopt(m_curl, CURLOPT_HTTPHEADER, headers);
-        
-        // Set request body
-        curl_easy_setopt(m_curl, CURLOPT_POSTFIELDS, requestBody.c_str());
-        
-        // Set write callback
-        curl_easy_setopt(m_curl, CURLOPT_WRITEFUNCTION, writeCallback);
-        curl_easy_setopt(m_curl, CURLOPT_WRITEDATA, &response);
-        
-        // Perform request
-        CURLcode res = curl_easy_perform(m_curl);
-        
-        // Clean up headers
-        curl_slist_free_all(headers);
-        
-        if (res != CURLE_OK) {
-            cerr << "API request failed: " << curl_easy_strerror(res) << endl;
-            return "";
+
+    static void writeSection(ofstream& file, size_t offset, const void* data, size_t size) {
+        static const char zeros[8] = { 0 };
+        file.write(zeros, offset - (size_t)file.tellp());
+        if (size) {
+            file.write((const char*)data, size);
         }
-        
-        // Parse response (simple extraction of content field)
-        return extractContent(response);
     }
-    
-    // Make API call with streaming
-    string makeApiCallStreaming(const string& requestBody, function<string(string)> callback) {
-        string response;
-        string accumulatedResponse;
-        
-        curl_easy_setopt(m_curl, CURLOPT_URL, m_apiEndpoint.c_str());
-        curl_easy_setopt(m_curl, CURLOPT_POST, 1L);
-        
-        // Set headers
-        struct curl_slist* headers = nullptr;
-        headers = curl_slist_append(headers, "Content-Type: application/json");
-        curl_easy_setopt(m_curl, CURLOPT_HTTPHEADER, headers);
-        
-        // Set request body
-        curl_easy_setopt(m_curl, CURLOPT_POSTFIELDS, requestBody.c_str());
-        
-        // Set write callback for streaming
-        curl_easy_setopt(m_curl, CURLOPT_WRITEFUNCTION, writeCallback);
-        curl_easy_setopt(m_curl, CURLOPT_WRITEDATA, &response);
-        
-        // Perform request
-        CURLcode res = curl_easy_perform(m_curl);
+
+    // Move to the most similar neighbor until none is better
+    uint32_t greedy(const float* q, uint32_t cur, float& curSim, size_t level) const {
+        bool changed = true;
+        while (changed) {
+            changed = false;
+            const uint32_t* neighbors = links(cur, level);
+            for (size_t i = 0; i < maxLinks(level) && neighbors[i] != NONE; i++) {
+                float sim = dot(q, vec(neighbors[i]), m_dim);
+                if (sim > curSim) {
+                    curSim = sim;
+                    cur = neighbors[i];
+                    changed = true;
+                }
+            }
+        }
+        return cur;
+    }
+
+    // Best first search of one level, returns up to ef (similarity, id) pairs, best first
+    vector<pair<float, uint32_t>> searchLayer(const float* q, uint32_t entry, size_t ef, size_t level) const {
+        // Visited marks are reused between searches, a new epoch clears them
+        thread_local vector<uint32_t> visited;
+        thread_local uint32_t epoch = 0;
+        if (visited.size() < m_count) {
+            visited.resize(m_count, 0);
+        }
+        if (++epoch == 0) {
+            fill(visited.begin(), visited.end(), 0);
+            epoch = 1;
+        }
         
-        // Clean up headers
-        curl_slist_free_all(headers);
+        priority_queue<pair<float, uint32_t>> candidates;
+        priority_queue<pair<float, uint32_t>, vector<pair<float, uint32_t>>, greater<pair<float, uint32_t>>> found;
+        float sim = dot(q, vec(entry), m_dim);
+        candidates.push({ sim, entry });
+        found.push({ sim, entry });
+        visited[entry] = epoch;
         
-        if (res != CURLE_OK) {
-            cerr << "API request failed: " << curl_easy_strerror(res) << endl;
-            return "";
+        while (!candidates.empty()) {
+            auto [candidateSim, candidate] = candidates.top();
+            if (found.size() >= ef && candidateSim < found.top().first) {
+                break;
+            }
+            candidates.pop();
+            const uint32_t* neighbors = links(candidate, level);
+            for (size_t i = 0; i < maxLinks(level) && neighbors[i] != NONE; i++) {
+                uint32_t neighbor = neighbors[i];
+                if (visited[neighbor] == epoch) {
+                    continue;
+                }
+                visited[neighbor] = epoch;
+                float neighborSim = dot(q, vec(neighbor), m_dim);
+                if (found.size() < ef || neighborSim > found.top().first) {
+                    candidates.push({ neighborSim, neighbor });
+                    found.push({ neighborSim, neighbor });
+                    if (found.size() > ef) {
+                        found.pop();
+                    }
+                }
+            }
         }
         
-        // Parse streaming response
-        istringstream stream(response);
-        string line;
-        while (getline(stream, line)) {
-            // Remove "data: " prefix if present
-            if (line.substr(0, 6) == "data: ") {
-                line = line.substr(6);
-            }
-            
-            // Skip empty lines and [DONE] marker
-            if (line.empty() || line == "[DONE]") {
-                continue;
+        vector<pair<float, uint32_t>> results(found.size());
+        for (size_t i = results.size(); i > 0; i--) {
+            results[i - 1] = found.top();
+            found.pop();
+        }
+        return results;
+    }
+
+    // Keep candidates (best first) that are closer to the base than to any
+    // neighbor kept before them, then fill up with the best of the rest
+    vector<uint32_t> selectNeighbors(const vector<pair<float, uint32_t>>& candidates, size_t count) const {
+        vector<uint32_t> selected;
+        vector<uint32_t> skipped;
+        for (const auto& [sim, id] : candidates) {
+            if (selected.size() >= count) {
+                break;
             }
-            
-            // Extract content from JSON line
-            string content = extractContent(line);
-            if (!content.empty()) {
-                string processedContent = callback(content);
-                cout << processedContent;
-                accumulatedResponse += processedContent;
+            bool diverse = true;
+            for (uint32_t other : selected) {
+                if (dot(vec(id), vec(other), m_dim) > sim) {
+                    diverse = false;
+                    break;
+                }
             }
+            (diverse ? selected : skipped).push_back(id);
+        }
+        for (size_t i = 0; i < skipped.size() && selected.size() < count; i++) {
+            selected.push_back(skipped[i]);
+        }
+        return selected;
+    }
+
+    void setLinks(uint32_t id, size_t level, const vector<uint32_t>& neighbors) {
+        uint32_t* slots = mutableLinks(id, level);
+        for (size_t i = 0; i < maxLinks(level); i++) {
+            slots[i] = i < neighbors.size() ? neighbors[i] : NONE;
+        }
+    }
+
+    void connect(uint32_t from, uint32_t to, size_t level) {
+        uint32_t* slots = mutableLinks(from, level);
+        size_t used = 0;
+        while (used < maxLinks(level) && slots[used] != NONE) {
+            used++;
+        }
+        if (used < maxLinks(level)) {
+            slots[used] = to;
+            return;
         }
         
-        cout << flush;
+        // Full, keep the best diverse set of the old neighbors and the new one
+        vector<pair<float, uint32_t>> candidates;
+        for (size_t i = 0; i < used; i++) {
+            candidates.push_back({ dot(vec(from), vec(slots[i]), m_dim), slots[i] });
+        }
+        candidates.push_back({ dot(vec(from), vec(to), m_dim), to });
+        sort(candidates.rbegin(), candidates.rend());
+        setLinks(from, level, selectNeighbors(candidates, maxLinks(level)));
+    }
+
+    void insert(uint32_t id) {
+        size_t level = (size_t)(-log(1.0 - uniform_real_distribution<double>(0, 1)(m_random)) * m_levelMult);
+        level = min(level, (size_t)255);
+        m_levelData.push_back((uint8_t)level);
+        m_upperOffsetData.push_back(m_upperLinkData.size());
+        m_upperLinkData.resize(m_upperLinkData.size() + level * m_M, NONE);
+        m_linkData.resize(m_linkData.size() + 2 * m_M, NONE);
+        refresh();
         
-        return accumulatedResponse;
+        if (m_entry == NONE) {
+            m_entry = id;
+            m_maxLevel = level;
+            return;
+        }
+        
+        const float* q = vec(id);
+        uint32_t cur = m_entry;
+        float curSim = dot(q, vec(cur), m_dim);
+        for (size_t l = m_maxLevel; l > level; l--) {
+            cur = greedy(q, cur, curSim, l);
+        }
+        for (size_t l = min(level, m_maxLevel) + 1; l > 0; l--) {
+            vector<pair<float, uint32_t>> candidates = searchLayer(q, cur, m_efConstruction, l - 1);
+            vector<uint32_t> neighbors = selectNeighbors(candidates, m_M);
+            setLinks(id, l - 1, neighbors);
+            for (uint32_t neighbor : neighbors) {
+                connect(neighbor, id, l - 1);
+            }
+            cur = candidates[0].second;
+        }
+        if (level > m_maxLevel) {
+            m_maxLevel = level;
+            m_entry = id;
+        }
     }
 };
 
@@ -322,6 +2306,10 @@ public:
                 instructs.push_back("DECISION: " + line.substr(8));
             } else if (line.substr(0, 8) == "COMMAND:") {
                 instructs.push_back("COMMAND: " + line.substr(8));
+            } else if (line.substr(0, 10) == "MAPREDUCE:") {
+                instructs.push_back("MAPREDUCE: " + line.substr(10));
+            } else if (line.substr(0, 9) == "RETRIEVE:") {
+                instructs.push_back("RETRIEVE: " + line.substr(9));
             } else {
                 // Regular instruction line
                 instructs.push_back(line);
@@ -333,6 +2321,11 @@ public:
         parse(m_text);
     }
 
+    // Conversations used by MAPREDUCE instructions, when not set a temporary pool shares the config and transport of the LLM
+    void setPool(SessionManager& pool) {
+        m_pool = &pool;
+    }
+
     // TODO: loop through the instructs and send them one by one to the LLM
     void run(LLM& llm) {
         for (const auto& instruction : instructs) {
@@ -354,6 +2347,14 @@ public:
                 string commandPrompt = instruction.substr(9);
                 string response = llm.prompt(commandPrompt);
                 cout << "Command: " << response << endl;
+            } else if (instruction.substr(0, 10) == "MAPREDUCE:") {
+                // Map-reduce instructions - "MAPREDUCE: <file> | <map prompt> | <reduce prompt>"
+                string response = mapReduce(instruction.substr(10), llm);
+                cout << "MapReduce: " << response << endl;
+            } else if (instruction.substr(0, 9) == "RETRIEVE:") {
+                // Retrieval instructions - "RETRIEVE: <index file> | <k> | <prompt>"
+                string response = retrieve(instruction.substr(9), llm);
+                cout << "Response: " << response << endl;
             } else {
                 // Regular prompt
                 string response = llm.prompt(instruction);
@@ -365,6 +2366,68 @@ public:
 protected:
     string m_text;
     vector<string> instructs;
+    SessionManager* m_pool = nullptr;
+
+    string mapReduce(const string& args, LLM& llm) {
+        vector<string> parts = split(args, '|');
+        if (parts.size() != 3) {
+            cerr << "Error: MAPREDUCE needs <file> | <map prompt> | <reduce prompt>" << endl;
+            return "";
+        }
+        
+        if (m_pool) {
+            return MapReduce(*m_pool).run(parts[0], parts[1], parts[2]);
+        }
+        // Same endpoint and model as the rest of the script, with enough connections for every chunk in flight
+        size_t concurrency = 8;
+        Transport transport(concurrency);
+        SessionManager pool(llm.configs(), transport, concurrency);
+        return MapReduce(pool, concurrency).run(parts[0], parts[1], parts[2]);
+    }
+
+    // Prompt with the k chunks of the index most similar to the prompt put in front of it
+    string retrieve(const string& args, LLM& llm) {
+        vector<string> parts = split(args, '|');
+        size_t k = parts.size() == 3 ? strtoul(parts[1].c_str(), nullptr, 10) : 0;
+        if (k == 0) {
+            cerr << "Error: RETRIEVE needs <index file> | <k> | <prompt>" << endl;
+            return "";
+        }
+        
+        VectorIndex index;
+        if (!index.load(parts[0])) {
+            return "";
+        }
+        Embeddings embeddings(llm.configs(), llm.transport());
+        vector<float> query = embeddings.embed(parts[2]);
+        if (query.empty()) {
+            return "";
+        }
+        if (query.size() != index.dim()) {
+            // A different embedding model than the one the index was built with, no context would match
+            cerr << "Error: Embedding of size " << query.size() << " does not match index " << parts[0] << " of dimension " << index.dim() << endl;
+            return "";
+        }
+        
+        string prompt = "Context:\n";
+        for (const auto& [id, similarity] : index.search(query, k)) {
+            prompt += "\n" + index.text(id) + "\n";
+        }
+        prompt += "\n" + parts[2];
+        return llm.prompt(prompt);
+    }
+
+    // Split on a separator and trim the parts
+    vector<string> split(const string& text, char separator) {
+        vector<string> parts;
+        istringstream stream(text);
+        string part;
+        while (getline(stream, part, separator)) {
+            trim(part);
+            parts.push_back(part);
+        }
+        return parts;
+    }
     
     // Helper function to trim whitespace
     void trim(string& str) {
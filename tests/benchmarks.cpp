@@ -0,0 +1,141 @@
+// Throughput and latency benchmarks, run as:
+//   benchmarks tokenizer <tokenizer.model> [text file]
+//   benchmarks index [vector count] [dimension]
+// Without a text file a synthetic document is generated. The index benchmark
+// uses random vectors (1M of dimension 128 by default) projected from a 16
+// dimensional space plus noise. Real embeddings have a low intrinsic
+// dimension, with i.i.d. random vectors every neighbor would look alike.
+
+#include "../Agency.hpp"
+#include <chrono>
+#include <thread>
+#include <random>
+
+using namespace std::chrono;
+
+static string benchmarks_text(int argc, char* argv[]) {
+    if (argc > 3) {
+        ifstream file(argv[3]);
+        stringstream buffer;
+        buffer << file.rdbuf();
+        return buffer.str();
+    }
+    static const char* words[] = {
+        "the", "quick", "brown", "fox", "jumps", "over", "lazy", "dog's", "tokenizer",
+        "counts", "2024", "messages,", "history;", "server", "request\n", "(budget)"
+    };
+    string text;
+    for (size_t i = 0; text.size() < 64 * 1024 * 1024; i++) {
+        text += words[(i * 7 + i / 13) % 16];
+        text += ' ';
+    }
+    return text;
+}
+
+static void benchmark_Tokenizer(const Tokenizer& tokenizer, const string& text, size_t threads) {
+    steady_clock::time_point start = steady_clock::now();
+    size_t tokens = tokenizer.count(text, threads);
+    double seconds = duration<double>(steady_clock::now() - start).count();
+    cout << "Tokenizer " << threads << " thread(s): " << tokens << " tokens in " << seconds << "s, "
+         << (size_t)(tokens / seconds / threads) << " tokens/s/core" << endl;
+}
+
+static int benchmarks_tokenizer(int argc, char* argv[]) {
+    Tokenizer tokenizer;
+    if (!tokenizer.load(argc > 2 ? argv[2] : "tokenizer.model")) {
+        return 1;
+    }
+    string text = benchmarks_text(argc, argv);
+    cout << "Text: " << text.size() << " bytes, vocab: " << tokenizer.vocabSize() << endl;
+
+    size_t cores = max(1u, thread::hardware_concurrency());
+    benchmark_Tokenizer(tokenizer, text, 1);
+    if (cores > 1) {
+        benchmark_Tokenizer(tokenizer, text, cores);
+    }
+    return 0;
+}
+
+static vector<float> benchmarks_vector(mt19937& random, const vector<vector<float>>& projection) {
+    normal_distribution<float> normal;
+    vector<float> latent(projection.size());
+    for (float& value : latent) {
+        value = normal(random);
+    }
+    vector<float> vec(projection[0].size());
+    for (size_t i = 0; i < vec.size(); i++) {
+        vec[i] = 0.05f * normal(random);
+        for (size_t j = 0; j < latent.size(); j++) {
+            vec[i] += latent[j] * projection[j][i];
+        }
+    }
+    return vec;
+}
+
+static int benchmarks_index(int argc, char* argv[]) {
+    size_t count = argc > 2 ? strtoul(argv[2], nullptr, 10) : 1000000;
+    size_t dim = argc > 3 ? strtoul(argv[3], nullptr, 10) : 128;
+    size_t queries = 100;
+    size_t k = 10;
+    mt19937 random(1);
+    normal_distribution<float> normal;
+    vector<vector<float>> projection(16, vector<float>(dim));
+    for (vector<float>& row : projection) {
+        for (float& value : row) {
+            value = normal(random) / sqrt(16.0f);
+        }
+    }
+
+    VectorIndex index(dim, true, 16, 100);
+    steady_clock::time_point start = steady_clock::now();
+    for (size_t i = 0; i < count; i++) {
+        index.add(benchmarks_vector(random, projection), "");
+        if ((i + 1) % 100000 == 0) {
+            cout << "Added " << i + 1 << " vectors" << endl;
+        }
+    }
+    cout << "Index: " << count << " vectors of dimension " << dim << " built in "
+         << duration<double>(steady_clock::now() - start).count() << "s" << endl;
+
+    vector<vector<float>> queryVectors;
+    vector<vector<pair<uint32_t, float>>> exact;
+    for (size_t i = 0; i < queries; i++) {
+        queryVectors.push_back(benchmarks_vector(random, projection));
+    }
+
+    start = steady_clock::now();
+    for (const vector<float>& query : queryVectors) {
+        exact.push_back(index.searchFlat(query, k));
+    }
+    cout << "Flat: " << duration<double, micro>(steady_clock::now() - start).count() / queries
+         << "us/query" << endl;
+
+    for (size_t ef : { 16, 32, 64, 128, 256 }) {
+        index.setEf(ef);
+        size_t hits = 0;
+        start = steady_clock::now();
+        for (size_t i = 0; i < queries; i++) {
+            for (const auto& [id, similarity] : index.search(queryVectors[i], k)) {
+                for (const auto& [exactId, exactSimilarity] : exact[i]) {
+                    hits += id == exactId;
+                }
+            }
+        }
+        double micros = duration<double, micro>(steady_clock::now() - start).count() / queries;
+        cout << "HNSW ef=" << ef << ": " << micros << "us/query, recall@" << k << " "
+             << (double)hits / (queries * k) << endl;
+    }
+    return 0;
+}
+
+int main(int argc, char* argv[]) {
+    string mode = argc > 1 ? argv[1] : "";
+    if (mode == "tokenizer") {
+        return benchmarks_tokenizer(argc, argv);
+    }
+    if (mode == "index") {
+        return benchmarks_index(argc, argv);
+    }
+    cerr << "Usage: benchmarks tokenizer <tokenizer.model> [text file] | index [vector count] [dimension]" << endl;
+    return 1;
+}
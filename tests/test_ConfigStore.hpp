@@ -0,0 +1,135 @@
+#pragma once
+
+#ifdef TEST
+
+#include <cassert>
+#include "../../misc/TEST.hpp"
+#include "../../misc/capture_cout_cerr.hpp"
+#include "../Agency.hpp"
+#include <thread>
+
+// ConfigStore tests
+TEST(test_ConfigStore_constructor) {
+    ConfigStore configs;
+    // Constructor should load config.ini into the first snapshot
+    assert(configs.snapshot() != nullptr);
+}
+
+TEST(test_ConfigStore_publish) {
+    ConfigStore configs;
+    shared_ptr<const LLMConfig> before = configs.snapshot();
+    
+    LLMConfig config = *before;
+    config.model = "test-model";
+    configs.publish(make_shared<LLMConfig>(config));
+    
+    // New snapshot should be seen right away, the old one stays valid for whoever holds it
+    assert(configs.snapshot()->model == "test-model");
+    assert(before->model != "test-model");
+    assert(configs.snapshot() == configs.snapshot());
+}
+
+TEST(test_ConfigStore_reload) {
+    string filename = "test_configstore.ini";
+    ofstream file(filename);
+    file << "[llm]\n";
+    file.close();
+    
+    ConfigStore configs(filename);
+    shared_ptr<const LLMConfig> before = configs.snapshot();
+    // Reload should publish a fresh snapshot
+    assert(configs.reload());
+    assert(configs.snapshot() != before);
+    
+    // Clean up
+    remove(filename.c_str());
+}
+
+TEST(test_ConfigStore_reload_missing_file) {
+    ConfigStore configs("test_configstore_missing.ini");
+    LLMConfig config = *configs.snapshot();
+    config.model = "test-model";
+    configs.publish(make_shared<LLMConfig>(config));
+    
+    // Capture output to avoid warnings
+    string output = capture_cout_cerr([&configs]() {
+        // A missing file should keep the current snapshot rather than publish defaults
+        assert(!configs.reload());
+    }, false);
+    assert(configs.snapshot()->model == "test-model");
+}
+
+TEST(test_ConfigStore_snapshot_per_store) {
+    ConfigStore first;
+    ConfigStore second;
+    LLMConfig config = *first.snapshot();
+    config.model = "first-model";
+    first.publish(make_shared<LLMConfig>(config));
+    config.model = "second-model";
+    second.publish(make_shared<LLMConfig>(config));
+    
+    // Alternating stores on one thread should hand out each store's own cached snapshot
+    shared_ptr<const LLMConfig> cached = first.snapshot();
+    for (int i = 0; i < 10; i++) {
+        assert(second.snapshot()->model == "second-model");
+        assert(first.snapshot() == cached);
+    }
+}
+
+TEST(test_ConfigStore_snapshot_across_threads) {
+    ConfigStore configs;
+    atomic<bool> stop(false);
+    thread reader([&configs, &stop]() {
+        while (!stop) {
+            // Readers should always get a complete snapshot while it is being replaced
+            assert(!configs.snapshot()->apiEndpoint.empty());
+        }
+    });
+    for (int i = 0; i < 1000; i++) {
+        LLMConfig config = *configs.snapshot();
+        config.model = "model " + to_string(i);
+        configs.publish(make_shared<LLMConfig>(config));
+    }
+    stop = true;
+    reader.join();
+    assert(configs.snapshot()->model == "model 999");
+}
+
+TEST(test_ConfigStore_watch) {
+    ConfigStore configs;
+    configs.watch();
+    configs.watch();
+    // Watching twice should be ignored, the destructor should stop the watcher
+}
+
+static atomic<int> test_ConfigStore_previousHangups(0);
+
+static void test_ConfigStore_previousHandler(int) {
+    test_ConfigStore_previousHangups++;
+}
+
+TEST(test_ConfigStore_watch_chains_previous_handler) {
+    struct sigaction previous = {};
+    previous.sa_handler = test_ConfigStore_previousHandler;
+    sigemptyset(&previous.sa_mask);
+    struct sigaction saved;
+    sigaction(SIGHUP, &previous, &saved);
+    {
+        ConfigStore configs;
+        configs.watch();
+        {
+            ConfigStore other;
+            other.watch();
+        }
+        raise(SIGHUP);
+        // The handler installed before watching should still be called
+        assert(test_ConfigStore_previousHangups == 1);
+    }
+    struct sigaction current;
+    sigaction(SIGHUP, nullptr, &current);
+    sigaction(SIGHUP, &saved, nullptr);
+    // Once the last store stops watching, the previous handler should be back
+    assert(current.sa_handler == test_ConfigStore_previousHandler);
+}
+
+#endif
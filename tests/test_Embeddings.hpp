@@ -0,0 +1,27 @@
+#pragma once
+
+#ifdef TEST
+
+#include "../../misc/TEST.hpp"
+#include "../../misc/capture_cout_cerr.hpp"
+#include "../Agency.hpp"
+
+// Embeddings tests
+TEST(test_Embeddings_constructor) {
+    LLM llm;
+    Embeddings embeddings(llm.configs(), llm.transport());
+    // Should share config and transport with the LLM
+}
+
+TEST(test_Embeddings_embed) {
+    Embeddings embeddings;
+    
+    // Capture output to avoid warnings
+    string output = capture_cout_cerr([&embeddings]() {
+        // This test would normally make actual API calls, in batches of 2
+        vector<vector<float>> vectors = embeddings.embed({ "one", "two", "three" }, 2);
+        // Should return one vector per input, or none if a batch fails
+    }, false);
+}
+
+#endif
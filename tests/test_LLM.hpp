@@ -2,6 +2,7 @@
 
 #ifdef TEST
 
+#include <cassert>
 #include "../../misc/TEST.hpp"
 #include "../../misc/capture_cout_cerr.hpp"
 #include "../Agency.hpp"
@@ -106,4 +107,28 @@ TEST(test_LLM_prompt_with_empty_string) {
     }, false);
 }
 
+TEST(test_LLM_countTokens) {
+    // Tiny tiktoken style ranks file: a, b, c, space, "ab", " ab"
+    string filename = "test_llm_tokenizer.model";
+    ofstream file(filename);
+    file << "YQ== 0\nYg== 1\nYw== 2\nIA== 3\nYWI= 4\nIGFi 5\n";
+    file.close();
+    
+    shared_ptr<Tokenizer> tokenizer = make_shared<Tokenizer>();
+    tokenizer->load(filename);
+    
+    LLM llm;
+    llm.setTokenizer(tokenizer);
+    llm.setSystemPrompt("ab");
+    // System prompt and prompt once each, with template overhead and their role,
+    // which is one token per byte in this tiny vocab
+    assert(llm.countTokens("ab ab") == (4 + 6 + 1) + (4 + 4 + 2));
+    // Cached system prompt count should be dropped when it changes
+    llm.setSystemPrompt("ab ab");
+    assert(llm.countTokens("ab ab") == (4 + 6 + 2) + (4 + 4 + 2));
+    
+    // Clean up
+    remove(filename.c_str());
+}
+
 #endif
\ No newline at end of file
@@ -0,0 +1,86 @@
+#pragma once
+
+#ifdef TEST
+
+#include <cassert>
+#include "../../misc/TEST.hpp"
+#include "../../misc/capture_cout_cerr.hpp"
+#include "../Agency.hpp"
+#include <fstream>
+
+// MapReduce tests
+TEST(test_MapReduce_split_on_boundaries) {
+    string text = "First line.\nSecond sentence. Third one!\nFourth line here.\n";
+    vector<pair<size_t, size_t>> chunks = MapReduce::split(text.data(), text.size(), 30, 0);
+    
+    // Chunks should cover the text, cut after a newline or sentence end
+    assert(chunks.front().first == 0);
+    assert(chunks.back().second == text.size());
+    for (size_t i = 0; i + 1 < chunks.size(); i++) {
+        assert(chunks[i].second == chunks[i + 1].first);
+        char last = text[chunks[i].second - 1];
+        assert(last == '\n' || last == '.' || last == '!');
+    }
+}
+
+TEST(test_MapReduce_split_with_overlap) {
+    string text(1000, 'x');
+    vector<pair<size_t, size_t>> chunks = MapReduce::split(text.data(), text.size(), 100, 20);
+    
+    // Without boundaries chunks are cut at full size and overlap by 20 bytes
+    assert(chunks.size() == 13);
+    for (size_t i = 0; i + 1 < chunks.size(); i++) {
+        assert(chunks[i].second - chunks[i].first == 100);
+        assert(chunks[i].second - chunks[i + 1].first == 20);
+    }
+}
+
+TEST(test_MapReduce_run_missing_file) {
+    SessionManager pool(1);
+    // Capture output to avoid warnings
+    string output = capture_cout_cerr([&pool]() {
+        string response = MapReduce(pool).run("nonexistent_input.txt", "Summarize:", "Merge:");
+        // Should handle missing file gracefully
+    }, false);
+}
+
+TEST(test_MapReduce_run_with_failed_chunks) {
+    string filename = "test_mapreduce_failing.txt";
+    ofstream file(filename);
+    for (int i = 0; i < 20; i++) {
+        file << "Sentence number " << i << ".\n";
+    }
+    file.close();
+    
+    // Session limit 0 rejects every prompt, so every chunk fails
+    SessionManager pool(1, 0);
+    // Capture output to avoid warnings
+    string output = capture_cout_cerr([&pool, &filename]() {
+        // A result missing parts of the document should not be returned
+        assert(MapReduce(pool, 4, 64, 8, 8, 1).run(filename, "Summarize:", "Merge:") == "");
+    }, false);
+    
+    // Clean up
+    remove(filename.c_str());
+}
+
+TEST(test_MapReduce_run) {
+    string filename = "test_mapreduce_input.txt";
+    ofstream file(filename);
+    for (int i = 0; i < 100; i++) {
+        file << "Sentence number " << i << ".\n";
+    }
+    file.close();
+    
+    SessionManager pool(2);
+    // Capture output to avoid warnings
+    string output = capture_cout_cerr([&pool, &filename]() {
+        // This test would normally make actual API calls, failed chunks are retried
+        string response = MapReduce(pool, 4, 256, 32).run(filename, "Summarize:", "Merge:");
+    }, false);
+    
+    // Clean up
+    remove(filename.c_str());
+}
+
+#endif
@@ -220,6 +220,52 @@ TEST(test_Script_run_with_command) {
     }, false);
 }
 
+TEST(test_Script_run_with_mapreduce) {
+    Script script;
+    script.parse("MAPREDUCE: input.txt | Summarize this part: | Merge these summaries:");
+    
+    LLM llm;
+    // Capture output to avoid warnings
+    string output = capture_cout_cerr([&script, &llm]() {
+        // Map-reduce instruction should be processed
+    }, false);
+}
+
+TEST(test_Script_run_with_malformed_mapreduce) {
+    Script script;
+    script.parse("MAPREDUCE: input.txt");
+    
+    LLM llm;
+    // Capture output to avoid warnings
+    string output = capture_cout_cerr([&script, &llm]() {
+        script.run(llm);
+        // Missing prompts should be reported, not crash
+    }, false);
+}
+
+TEST(test_Script_run_with_retrieve) {
+    Script script;
+    script.parse("RETRIEVE: index.bin | 3 | What does the manual say about backups?");
+    
+    LLM llm;
+    // Capture output to avoid warnings
+    string output = capture_cout_cerr([&script, &llm]() {
+        // Retrieval instruction should be processed
+    }, false);
+}
+
+TEST(test_Script_run_with_malformed_retrieve) {
+    Script script;
+    script.parse("RETRIEVE: index.bin | many | Hello");
+    
+    LLM llm;
+    // Capture output to avoid warnings
+    string output = capture_cout_cerr([&script, &llm]() {
+        script.run(llm);
+        // Invalid k should be reported, not crash
+    }, false);
+}
+
 // Exception tests
 TEST(test_Script_load_empty_file) {
     string filename = "empty_script.txt";
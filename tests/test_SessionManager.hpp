@@ -0,0 +1,157 @@
+#pragma once
+
+#ifdef TEST
+
+#include <cassert>
+#include "../../misc/TEST.hpp"
+#include "../../misc/capture_cout_cerr.hpp"
+#include "../Agency.hpp"
+#include <fstream>
+
+// SessionManager tests
+TEST(test_SessionManager_constructor) {
+    SessionManager manager(2, 4, "test_sessions");
+    // Constructor should load config once and start the workers
+}
+
+TEST(test_SessionManager_shared_transport) {
+    LLM llm;
+    SessionManager manager(llm.configs(), llm.transport(), 2, 4, "test_sessions");
+    // Sessions should use the config and connections of the LLM
+}
+
+TEST(test_SessionManager_submit_callback) {
+    SessionManager manager(1, 0, "test_sessions");
+    promise<string> result;
+    
+    // Capture output to avoid warnings
+    string output = capture_cout_cerr([&manager, &result]() {
+        manager.submit("alice", "Hello", [&result](const string& response) { result.set_value(response); });
+    }, false);
+    // Callback should be called even when the request is rejected
+    assert(result.get_future().get() == "");
+}
+
+TEST(test_SessionManager_submit) {
+    SessionManager manager(2, 4, "test_sessions");
+    
+    // Capture output to avoid warnings
+    string output = capture_cout_cerr([&manager]() {
+        // This test would normally make actual API calls
+        future<string> first = manager.submit("alice", "Hello");
+        future<string> second = manager.submit("bob", "Hello");
+        first.get();
+        second.get();
+        // Both sessions should be answered through the shared transport
+    }, false);
+}
+
+TEST(test_SessionManager_limit) {
+    SessionManager manager(1, 4, "test_sessions");
+    manager.setLimit("alice", 0);
+    
+    // Capture output to avoid warnings
+    string output = capture_cout_cerr([&manager]() {
+        string response = manager.submit("alice", "Hello").get();
+        // Request over the limit should be rejected with an empty response
+    }, false);
+}
+
+TEST(test_SessionManager_evict_and_restore) {
+    SessionManager manager(1, 4, "test_sessions");
+    manager.setSystemPrompt("alice", "You are a test assistant.").get();
+    
+    manager.evictIdle(chrono::seconds(0));
+    // Idle session should be written to disk and dropped from memory
+    
+    manager.setLimit("alice", 4);
+    // Touching the session should bring it back with its history
+    
+    manager.close("alice");
+    filesystem::remove_all("test_sessions");
+}
+
+TEST(test_SessionManager_evict_during_traffic) {
+    SessionManager manager(1, 4, "test_sessions", chrono::seconds(1));
+    manager.setSystemPrompt("idle", "You are a test assistant.").get();
+    
+    // Capture output to avoid warnings
+    string output = capture_cout_cerr([&manager]() {
+        // Steady traffic on one session should not keep the idle one in memory
+        chrono::steady_clock::time_point end = chrono::steady_clock::now() + chrono::milliseconds(2500);
+        while (chrono::steady_clock::now() < end) {
+            manager.submit("busy", "Hello").get();
+        }
+    }, false);
+    assert(manager.isEvicted("idle"));
+    
+    filesystem::remove_all("test_sessions");
+}
+
+TEST(test_SessionManager_evict_long_id) {
+    SessionManager manager(1, 4, "test_sessions");
+    string id(300, 'x');
+    manager.setSystemPrompt(id, "You are a test assistant.").get();
+    
+    // Ids longer than a file name allows should still be parked
+    assert(manager.evictIdle(chrono::seconds(0)) == 1);
+    assert(manager.isEvicted(id));
+    manager.setLimit(id, 4);
+    assert(!manager.isEvicted(id));
+    
+    manager.close(id);
+    filesystem::remove_all("test_sessions");
+}
+
+TEST(test_SessionManager_restore_corrupt_file) {
+    SessionManager manager(1, 4, "test_sessions");
+    manager.setSystemPrompt("carol", "You are a test assistant.").get();
+    manager.evictIdle(chrono::seconds(0));
+    
+    // Parked file of "carol" (hex encoded id) gets damaged
+    ofstream file("test_sessions/6361726f6c.session");
+    file << "garbage";
+    file.close();
+    
+    // Capture output to avoid warnings
+    string output = capture_cout_cerr([&manager]() {
+        manager.setLimit("carol", 4);
+    }, false);
+    // Unreadable history should be kept aside, not deleted
+    assert(filesystem::exists("test_sessions/6361726f6c.session.bad"));
+    
+    manager.close("carol");
+    filesystem::remove_all("test_sessions");
+}
+
+TEST(test_SessionManager_restore_corrupt_size) {
+    SessionManager manager(1, 4, "test_sessions");
+    manager.setSystemPrompt("dave", "You are a test assistant.").get();
+    manager.evictIdle(chrono::seconds(0));
+    // Parking should go through a temporary file that is renamed into place
+    assert(filesystem::exists("test_sessions/64617665.session"));
+    assert(!filesystem::exists("test_sessions/64617665.session.tmp"));
+    
+    // Parked file of "dave" claims a system prompt far larger than the file
+    ofstream file("test_sessions/64617665.session");
+    file << "18446744073709551615\nYou are";
+    file.close();
+    
+    // Capture output to avoid warnings
+    string output = capture_cout_cerr([&manager]() {
+        manager.setLimit("dave", 4);
+    }, false);
+    // A corrupted size should fail the restore, not throw out of setLimit()
+    assert(filesystem::exists("test_sessions/64617665.session.bad"));
+    
+    manager.close("dave");
+    filesystem::remove_all("test_sessions");
+}
+
+TEST(test_SessionManager_close_unknown) {
+    SessionManager manager(1, 4, "test_sessions");
+    manager.close("nobody");
+    // Closing an unknown session should be ignored
+}
+
+#endif
@@ -0,0 +1,94 @@
+#pragma once
+
+#ifdef TEST
+
+#include <cassert>
+#include "../../misc/TEST.hpp"
+#include "../../misc/capture_cout_cerr.hpp"
+#include "../Agency.hpp"
+#include <fstream>
+
+// Writes a tiny tiktoken style ranks file: a, b, c, space, "ab", " ab"
+inline string test_Tokenizer_ranks_file() {
+    string filename = "test_tokenizer.model";
+    ofstream file(filename);
+    file << "YQ== 0\nYg== 1\nYw== 2\nIA== 3\nYWI= 4\nIGFi 5\n";
+    file.close();
+    return filename;
+}
+
+// Tokenizer tests
+TEST(test_Tokenizer_load) {
+    string filename = test_Tokenizer_ranks_file();
+    
+    Tokenizer tokenizer;
+    assert(tokenizer.load(filename));
+    assert(tokenizer.vocabSize() == 6);
+    
+    // Clean up
+    remove(filename.c_str());
+}
+
+TEST(test_Tokenizer_load_missing_file) {
+    Tokenizer tokenizer;
+    // Capture output to avoid warnings
+    string output = capture_cout_cerr([&tokenizer]() {
+        tokenizer.load("nonexistent_tokenizer.model");
+        // Should handle missing file gracefully
+    }, false);
+}
+
+TEST(test_Tokenizer_encode) {
+    string filename = test_Tokenizer_ranks_file();
+    
+    Tokenizer tokenizer;
+    tokenizer.load(filename);
+    vector<uint32_t> tokens = tokenizer.encode("ab ab c");
+    // "ab" " ab" " c" has no " c" token, so the space stays on its own
+    assert((tokens == vector<uint32_t>{ 4, 5, 3, 2 }));
+    assert(tokenizer.count("ab ab c") == 4);
+    
+    // Clean up
+    remove(filename.c_str());
+}
+
+TEST(test_Tokenizer_count_parallel) {
+    string filename = test_Tokenizer_ranks_file();
+    
+    Tokenizer tokenizer;
+    tokenizer.load(filename);
+    string text;
+    for (int i = 0; i < 10000; i++) {
+        text += "ab cab ";
+    }
+    // Counting in parallel should give the same result as a single thread
+    assert(tokenizer.count(text, 4) == tokenizer.count(text));
+    
+    // Clean up
+    remove(filename.c_str());
+}
+
+TEST(test_Tokenizer_load_malformed_rank) {
+    string filename = "test_tokenizer_bad.model";
+    ofstream file(filename);
+    file << "YQ== 0\nYg== one\n";
+    file.close();
+    
+    Tokenizer tokenizer;
+    // Capture output to avoid warnings
+    string output = capture_cout_cerr([&tokenizer, &filename]() {
+        // Bad rank should be reported, not thrown
+        assert(!tokenizer.load(filename));
+    }, false);
+    
+    // Clean up
+    remove(filename.c_str());
+}
+
+TEST(test_Tokenizer_encode_unloaded) {
+    Tokenizer tokenizer;
+    // Without a vocab every byte is an unknown token
+    assert((tokenizer.encode("ab") == vector<uint32_t>{ UINT32_MAX, UINT32_MAX }));
+}
+
+#endif
@@ -0,0 +1,198 @@
+#pragma once
+
+#ifdef TEST
+
+#include <cassert>
+#include "../../misc/TEST.hpp"
+#include "../../misc/capture_cout_cerr.hpp"
+#include "../Agency.hpp"
+#include <random>
+
+// Random vectors for VectorIndex tests
+inline vector<vector<float>> test_VectorIndex_vectors(size_t count, size_t dim, unsigned seed) {
+    mt19937 random(seed);
+    normal_distribution<float> normal;
+    vector<vector<float>> vectors(count, vector<float>(dim));
+    for (vector<float>& vec : vectors) {
+        for (float& value : vec) {
+            value = normal(random);
+        }
+    }
+    return vectors;
+}
+
+// VectorIndex tests
+TEST(test_VectorIndex_dot) {
+    vector<float> a(37), b(37);
+    float expected = 0;
+    for (size_t i = 0; i < a.size(); i++) {
+        a[i] = (float)i;
+        b[i] = 1.0f / (i + 1);
+        expected += a[i] * b[i];
+    }
+    // SIMD and scalar tail should add up to the plain sum
+    assert(fabs(VectorIndex::dot(a.data(), b.data(), a.size()) - expected) < 1e-4);
+}
+
+TEST(test_VectorIndex_searchFlat) {
+    VectorIndex index(3, false);
+    index.add({ 1, 0, 0 }, "x");
+    index.add({ 0, 1, 0 }, "y");
+    index.add({ 0, 0, 2 }, "z");
+    
+    vector<pair<uint32_t, float>> results = index.searchFlat({ 0.1f, 0, 1 }, 2);
+    // Best first, vectors are normalized so "z" matches despite its length
+    assert(results.size() == 2);
+    assert(index.text(results[0].first) == "z");
+    assert(index.text(results[1].first) == "x");
+}
+
+TEST(test_VectorIndex_add_wrong_dimension) {
+    VectorIndex index(3);
+    // Capture output to avoid warnings
+    string output = capture_cout_cerr([&index]() {
+        index.add({ 1, 0 }, "short");
+        // Should be rejected without growing the index
+    }, false);
+    assert(index.size() == 0);
+}
+
+TEST(test_VectorIndex_hnsw_recall) {
+    VectorIndex index(16, true, 8, 64);
+    for (const vector<float>& vec : test_VectorIndex_vectors(2000, 16, 1)) {
+        index.add(vec, "");
+    }
+    
+    size_t hits = 0;
+    vector<vector<float>> queries = test_VectorIndex_vectors(50, 16, 2);
+    for (const vector<float>& query : queries) {
+        hits += index.search(query, 1)[0].first == index.searchFlat(query, 1)[0].first;
+    }
+    // Graph search should almost always find the exact nearest neighbor here
+    assert(hits >= 45);
+}
+
+TEST(test_VectorIndex_save_and_load) {
+    string filename = "test_vector_index.bin";
+    vector<vector<float>> vectors = test_VectorIndex_vectors(300, 8, 3);
+    
+    VectorIndex index(8, true, 8, 32);
+    for (size_t i = 0; i < vectors.size(); i++) {
+        index.add(vectors[i], "chunk " + to_string(i));
+    }
+    assert(index.save(filename));
+    
+    VectorIndex loaded;
+    assert(loaded.load(filename));
+    assert(loaded.size() == 300 && loaded.dim() == 8);
+    assert(loaded.text(42) == "chunk 42");
+    // Mapped index should answer exactly like the one it was saved from
+    assert(loaded.search(vectors[7], 5) == index.search(vectors[7], 5));
+    
+    // Adding to a mapped index copies it into memory first
+    loaded.add(vectors[0], "copy");
+    assert(loaded.size() == 301 && loaded.text(300) == "copy");
+    
+    // Clean up
+    remove(filename.c_str());
+}
+
+TEST(test_VectorIndex_save_over_mapped_file) {
+    string filename = "test_vector_index_resave.bin";
+    VectorIndex index(4);
+    for (const vector<float>& vec : test_VectorIndex_vectors(50, 4, 4)) {
+        index.add(vec, "chunk");
+    }
+    assert(index.save(filename));
+    
+    VectorIndex loaded;
+    assert(loaded.load(filename));
+    // Rewriting the file the index is mapped from should not pull it from under the mapping
+    assert(loaded.save(filename));
+    assert(loaded.text(49) == "chunk");
+    
+    VectorIndex reloaded;
+    assert(reloaded.load(filename));
+    assert(reloaded.size() == 50);
+    
+    // Clean up
+    remove(filename.c_str());
+}
+
+TEST(test_VectorIndex_load_corrupt_header) {
+    string filename = "test_vector_index_corrupt.bin";
+    VectorIndex index(4);
+    for (const vector<float>& vec : test_VectorIndex_vectors(10, 4, 5)) {
+        index.add(vec, "");
+    }
+    assert(index.save(filename));
+    
+    // Header fields are 8 byte words after the magic: dim, count, M, hnsw, maxLevel, entry, ...
+    auto corrupt = [&filename](size_t field, uint64_t value) {
+        fstream file(filename, ios::in | ios::out | ios::binary);
+        file.seekp(8 + field * 8);
+        file.write((const char*)&value, sizeof(value));
+    };
+    
+    VectorIndex loaded;
+    // Capture output to avoid warnings
+    string output = capture_cout_cerr([&]() {
+        corrupt(5, 10); // entry past the last vector
+        assert(!loaded.load(filename));
+        corrupt(5, 0);
+        corrupt(2, 1); // M too small
+        assert(!loaded.load(filename));
+        corrupt(2, 16);
+        corrupt(0, UINT64_MAX / 2); // dim * count overflows
+        assert(!loaded.load(filename));
+    }, false);
+    
+    // Clean up
+    remove(filename.c_str());
+}
+
+TEST(test_VectorIndex_load_corrupt_sections) {
+    string filename = "test_vector_index_corrupt.bin";
+    VectorIndex index(4, true, 16);
+    for (const vector<float>& vec : test_VectorIndex_vectors(10, 4, 6)) {
+        index.add(vec, "");
+    }
+    
+    auto corrupt = [&filename](streamoff offset, ios::seekdir from, uint32_t value) {
+        fstream file(filename, ios::in | ios::out | ios::binary);
+        file.seekp(offset, from);
+        file.write((const char*)&value, sizeof(value));
+    };
+    
+    VectorIndex loaded;
+    // Capture output to avoid warnings
+    string output = capture_cout_cerr([&]() {
+        // First level 0 link follows the 72 byte header and 10 vectors of 4 floats
+        assert(index.save(filename));
+        corrupt(72 + 10 * 4 * sizeof(float), ios::beg, 1000);
+        assert(!loaded.load(filename));
+        
+        // Last text offset closes the file, as there are no texts
+        assert(index.save(filename));
+        corrupt(-8, ios::end, 1000);
+        assert(!loaded.load(filename));
+        
+        assert(index.save(filename));
+        assert(loaded.load(filename));
+        assert(loaded.text(10) == "");
+    }, false);
+    
+    // Clean up
+    remove(filename.c_str());
+}
+
+TEST(test_VectorIndex_load_missing_file) {
+    VectorIndex index;
+    // Capture output to avoid warnings
+    string output = capture_cout_cerr([&index]() {
+        index.load("nonexistent_index.bin");
+        // Should handle missing file gracefully
+    }, false);
+}
+
+#endif
@@ -4,6 +4,12 @@
 #ifdef TEST
 #include "test_LLM.hpp"
 #include "test_Script.hpp"
+#include "test_SessionManager.hpp"
+#include "test_Tokenizer.hpp"
+#include "test_MapReduce.hpp"
+#include "test_Embeddings.hpp"
+#include "test_VectorIndex.hpp"
+#include "test_ConfigStore.hpp"
 #endif // TEST
 
 int main() {